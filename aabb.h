@@ -0,0 +1,80 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+
+#include <float.h>
+#include <stdint.h>
+
+struct aabb {
+    vec3 pmin;
+    vec3 pmax;
+
+    aabb():pmin(FLT_MAX, FLT_MAX, FLT_MAX), pmax(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+    aabb(const vec3& a, const vec3& b):pmin(a), pmax(b) {}
+
+    void grow(const vec3& p) {
+        pmin = vec3(min(pmin.x, p.x), min(pmin.y, p.y), min(pmin.z, p.z));
+        pmax = vec3(max(pmax.x, p.x), max(pmax.y, p.y), max(pmax.z, p.z));
+    }
+
+    void grow(const aabb& b) {
+        pmin = vec3(min(pmin.x, b.pmin.x), min(pmin.y, b.pmin.y), min(pmin.z, b.pmin.z));
+        pmax = vec3(max(pmax.x, b.pmax.x), max(pmax.y, b.pmax.y), max(pmax.z, b.pmax.z));
+    }
+
+    bool is_empty() const { return pmin.x > pmax.x; }
+
+    vec3 center() const { return Real(0.5) * (pmin + pmax); }
+    vec3 extent() const { return pmax - pmin; }
+
+    Real area() const {
+        if(is_empty())
+            return 0;
+        vec3 e = extent();
+        return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+};
+
+INLINE vec3 inv_direction(const vec3& d) {
+    return vec3(Real(1) / d.x, Real(1) / d.y, Real(1) / d.z);
+}
+
+// slab test, inv_dir is 1/ray.dir precomputed once per ray
+INLINE bool ray_aabb_intersect(const vec3& orig, const vec3& inv_dir, const aabb& b,
+                               Real t_min, Real t_max, Real* t_entry) {
+    Real tx0 = (b.pmin.x - orig.x) * inv_dir.x;
+    Real tx1 = (b.pmax.x - orig.x) * inv_dir.x;
+    Real ty0 = (b.pmin.y - orig.y) * inv_dir.y;
+    Real ty1 = (b.pmax.y - orig.y) * inv_dir.y;
+    Real tz0 = (b.pmin.z - orig.z) * inv_dir.z;
+    Real tz1 = (b.pmax.z - orig.z) * inv_dir.z;
+
+    Real t0 = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), t_min));
+    Real t1 = min(min(max(tx0, tx1), max(ty0, ty1)), min(max(tz0, tz1), t_max));
+
+    *t_entry = t0;
+    return t0 <= t1;
+}
+
+// spreads lower 10 bits of v apart leaving 2 zero bits between them
+INLINE uint32_t morton_expand_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// 30 bit Morton code of p quantized to 1024^3 grid over bounds, points close
+// to each other mostly get close codes
+INLINE uint32_t morton_code(const vec3& p, const aabb& b) {
+    const vec3 e = b.extent();
+    const Real fx = e.x > 0 ? min(max((p.x - b.pmin.x) / e.x, Real(0)), Real(1)) : Real(0);
+    const Real fy = e.y > 0 ? min(max((p.y - b.pmin.y) / e.y, Real(0)), Real(1)) : Real(0);
+    const Real fz = e.z > 0 ? min(max((p.z - b.pmin.z) / e.z, Real(0)), Real(1)) : Real(0);
+    return (morton_expand_bits((uint32_t)(fx * Real(1023))) << 2) |
+           (morton_expand_bits((uint32_t)(fy * Real(1023))) << 1) |
+            morton_expand_bits((uint32_t)(fz * Real(1023)));
+}
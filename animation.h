@@ -0,0 +1,49 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+
+#include <cmath>
+
+INLINE vec3 rotate_around_axis(const vec3& v, const vec3& unit_axis, Real radians) {
+    const Real c = cos(radians);
+    const Real s = sin(radians);
+    return c * v + s * cross(unit_axis, v) + (1 - c) * dot(unit_axis, v) * unit_axis;
+}
+
+// Motion of a sphere or mesh read from its <animate> element, which may
+// contain <rotation degrees_per_frame> with optional <axis> and <pivot>,
+// <translation> and <wave amplitude length speed>. At frame f a point is
+// displaced by the wave, rotated by f * degrees_per_frame around the axis
+// through pivot and then moved by f * translation, so rigid motions start
+// from the rest pose.
+// Number of frames is set by <animation frames> of the scene.
+struct object_motion {
+    vec3 pivot = vec3(0, 0, 0);
+    // unit length
+    vec3 axis = vec3(0, 1, 0);
+    Real degrees_per_frame = 0;
+    vec3 translation = vec3(0, 0, 0);
+    // sine displacement along y travelling along x, deforms meshes
+    Real wave_amplitude = 0;
+    Real wave_length = 1;
+    // in waves per frame
+    Real wave_speed = 0;
+
+    // normals are only rotated, deformed meshes get face normals instead
+    bool is_rigid() const { return wave_amplitude == 0; }
+
+    vec3 apply(const vec3& p, int frame) const {
+        vec3 q = p;
+        if(!is_rigid()) {
+            const Real phase = q.x / wave_length + wave_speed * Real(frame);
+            q.y += wave_amplitude * sin(Real(2 * M_PI) * phase);
+        }
+        const Real angle = degrees_to_radians(degrees_per_frame * Real(frame));
+        return pivot + rotate_around_axis(q - pivot, axis, angle) + Real(frame) * translation;
+    }
+
+    vec3 apply_normal(const vec3& n, int frame) const {
+        return rotate_around_axis(n, axis, degrees_to_radians(degrees_per_frame * Real(frame)));
+    }
+};
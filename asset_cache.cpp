@@ -0,0 +1,90 @@
+#include "asset_cache.h"
+#include "obj_loader.h"
+#include "mesh.h"
+
+namespace {
+
+// lock has to be held
+template <typename KEY, typename T>
+std::shared_ptr<T> find_alive(const std::map<KEY, std::weak_ptr<T>>& entries, const KEY& key) {
+    auto it = entries.find(key);
+    return it != entries.end() ? it->second.lock() : nullptr;
+}
+
+// lock has to be held, returns asset kept under key
+template <typename KEY, typename T>
+std::shared_ptr<T> insert(std::map<KEY, std::weak_ptr<T>>& entries, const KEY& key,
+                          const std::shared_ptr<T>& loaded) {
+    // somebody else may have loaded it meanwhile, the first one is kept
+    std::weak_ptr<T>& entry = entries[key];
+    if(std::shared_ptr<T> asset = entry.lock())
+        return asset;
+    entry = loaded;
+
+    // forget assets freed since the last load
+    for(auto it = entries.begin(); it != entries.end();) {
+        if(it->second.expired())
+            it = entries.erase(it);
+        else
+            ++it;
+    }
+    return loaded;
+}
+
+template <typename KEY, typename T, typename LOADER>
+std::shared_ptr<T> get_or_load(std::mutex& lock, std::map<KEY, std::weak_ptr<T>>& entries,
+                               const KEY& key, const LOADER& load) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(std::shared_ptr<T> asset = find_alive(entries, key))
+            return asset;
+    }
+
+    std::shared_ptr<T> loaded = load();
+    if(!loaded)
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+    return insert(entries, key, loaded);
+}
+
+template <typename KEY, typename T>
+int count_alive(const std::map<KEY, std::weak_ptr<T>>& entries) {
+    int count = 0;
+    for(const auto& e: entries) {
+        count += e.second.expired() ? 0 : 1;
+    }
+    return count;
+}
+
+}
+
+std::shared_ptr<const ObjFile> asset_cache::get_obj(const std::string& key, const obj_loader_fn& load) {
+    return get_or_load(lock, objs, key, load);
+}
+
+std::shared_ptr<mesh> asset_cache::find_mesh(const std::string& key, bvh_build_method method) const {
+    std::lock_guard<std::mutex> guard(lock);
+    return find_alive(meshes, std::make_pair(key, (int)method));
+}
+
+std::shared_ptr<mesh> asset_cache::add_mesh(const std::string& key, bvh_build_method method,
+                                            const std::shared_ptr<mesh>& m) {
+    std::lock_guard<std::mutex> guard(lock);
+    return insert(meshes, std::make_pair(key, (int)method), m);
+}
+
+int asset_cache::get_num_objs() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return count_alive(objs);
+}
+
+int asset_cache::get_num_meshes() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return count_alive(meshes);
+}
+
+asset_cache& asset_cache::global() {
+    static asset_cache cache;
+    return cache;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+struct ObjFile;
+class mesh;
+
+// Reference counted obj files and meshes built from them, keyed by obj path
+// and anything else telling versions of the file apart.
+// A file is loaded once and shared by every scene or mesh element asking for
+// it while anybody still holds it, it is freed together with its last user.
+// The cache itself only keeps weak references. Loaders run without the
+// lock held, so they may use the cache too.
+class asset_cache {
+  public:
+    using obj_loader_fn = std::function<std::shared_ptr<const ObjFile>()>;
+
+    // obj of the given key, load() is only called if nobody holds it, null
+    // if it fails
+    std::shared_ptr<const ObjFile> get_obj(const std::string& key, const obj_loader_fn& load);
+
+    // Meshes are shared only once their hierarchy is built, so users never
+    // see one which is still being built. A mesh of the given obj with
+    // hierarchy built by method, null if nobody holds one.
+    std::shared_ptr<mesh> find_mesh(const std::string& key, bvh_build_method method) const;
+    // Shares a built mesh. If somebody added one for the same key meanwhile,
+    // that one is kept and returned.
+    std::shared_ptr<mesh> add_mesh(const std::string& key, bvh_build_method method,
+                                   const std::shared_ptr<mesh>& m);
+
+    // assets which are still in use
+    int get_num_objs() const;
+    int get_num_meshes() const;
+
+    // cache of the whole process, used by scenes unless they are given one
+    static asset_cache& global();
+
+  private:
+    mutable std::mutex lock;
+    std::map<std::string, std::weak_ptr<const ObjFile>> objs;
+    std::map<std::pair<std::string, int>, std::weak_ptr<mesh>> meshes;
+};
@@ -0,0 +1,615 @@
+#include "bvh.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace {
+
+const int kNumBins = 16;
+// relative cost of a node visit vs. a primitive intersection
+const Real kTraversalCost = Real(1);
+// nodes with fewer primitives are never split across threads
+const int kMinSubtreeSize = 4096;
+// primitives binned by one task when a big node is split in parallel
+const int kBinChunkSize = 64 << 10;
+// Morton codes are sorted 10 bits per pass, chunks of keys are counted and
+// scattered by separate tasks
+const int kRadixBits = 10;
+const int kRadixBuckets = 1 << kRadixBits;
+const int kSortChunkSize = 64 << 10;
+
+struct bin {
+    aabb bounds;
+    int count = 0;
+};
+
+struct node_bins {
+    bin axes[3][kNumBins];
+};
+
+// primitive data shared by all nodes of one hierarchy
+struct build_context {
+    const aabb* prim_bounds;
+    const vec3* centroids;
+    int32_t* prim_indices;
+    int max_leaf_size;
+    // sorted Morton codes of prim_indices for LBVH, null for SAH
+    const uint32_t* codes;
+};
+
+// subtree built by a single task, nodes below its root go to
+// [base, base + 2 * count - 2)
+struct subtree_task {
+    int job;
+    int32_t root;
+    int first;
+    int count;
+    int depth;
+    int32_t base;
+    // nodes actually used, known once built
+    int32_t num_nodes;
+};
+
+// runs fn for all tasks on the pool, or inline without one
+void run_tasks(thread_pool* pool, int num_tasks, const thread_pool::task_fn& fn) {
+    if(pool && num_tasks > 1) {
+        pool->parallel_for(num_tasks, fn);
+    } else {
+        for(int i=0; i<num_tasks; ++i) {
+            fn(i, 0);
+        }
+    }
+}
+
+void range_bounds(const build_context& c, int first, int count, aabb* bounds, aabb* centroid_bounds) {
+    for(int i = first; i < first + count; ++i) {
+        bounds->grow(c.prim_bounds[c.prim_indices[i]]);
+        centroid_bounds->grow(c.centroids[c.prim_indices[i]]);
+    }
+}
+
+void bin_range(const build_context& c, int first, int count, const aabb& centroid_bounds, node_bins* bins) {
+    const vec3 cmin = centroid_bounds.pmin;
+    const vec3 cext = centroid_bounds.extent();
+    for(int axis = 0; axis < 3; ++axis) {
+        const Real ext = (&cext.x)[axis];
+        if(ext <= Real(0))
+            continue;
+        const Real k = Real(kNumBins) / ext;
+        bin* axis_bins = bins->axes[axis];
+        for(int i = first; i < first + count; ++i) {
+            const int prim = c.prim_indices[i];
+            int b = (int)(((&c.centroids[prim].x)[axis] - (&cmin.x)[axis]) * k);
+            b = clamp(b, 0, kNumBins - 1);
+            axis_bins[b].count++;
+            axis_bins[b].bounds.grow(c.prim_bounds[prim]);
+        }
+    }
+}
+
+// Bounds and bins of a big node, chunks of primitives are processed in
+// parallel and merged. Min/max and counts do not depend on the order, so
+// results are the same as in a single pass.
+void parallel_bounds_and_bins(const build_context& c, int first, int count, thread_pool* pool,
+                              aabb* bounds, aabb* centroid_bounds, node_bins* bins) {
+    const int num_chunks = (count + kBinChunkSize - 1) / kBinChunkSize;
+    std::vector<aabb> chunk_bounds(num_chunks), chunk_centroid_bounds(num_chunks);
+    pool->parallel_for(num_chunks, [&](int i, int) {
+        const int chunk_first = first + i * kBinChunkSize;
+        range_bounds(c, chunk_first, min(kBinChunkSize, first + count - chunk_first),
+                     &chunk_bounds[i], &chunk_centroid_bounds[i]);
+    });
+    for(int i=0; i<num_chunks; ++i) {
+        bounds->grow(chunk_bounds[i]);
+        centroid_bounds->grow(chunk_centroid_bounds[i]);
+    }
+
+    std::vector<node_bins> chunk_bins(num_chunks);
+    pool->parallel_for(num_chunks, [&](int i, int) {
+        const int chunk_first = first + i * kBinChunkSize;
+        bin_range(c, chunk_first, min(kBinChunkSize, first + count - chunk_first),
+                  *centroid_bounds, &chunk_bins[i]);
+    });
+    for(const node_bins& cb: chunk_bins) {
+        for(int axis = 0; axis < 3; ++axis) {
+            for(int b = 0; b < kNumBins; ++b) {
+                bins->axes[axis][b].count += cb.axes[axis][b].count;
+                bins->axes[axis][b].bounds.grow(cb.axes[axis][b].bounds);
+            }
+        }
+    }
+}
+
+// Fills node for primitives [first, first + count) and decides whether to
+// split it with binned SAH. Returns split position, or -1 if the node stays
+// a leaf. Binning is spread over the pool if one is given.
+int split_node(const build_context& c, bvh_node* node, int first, int count, int depth,
+               thread_pool* pool) {
+
+    aabb bounds, centroid_bounds;
+    node_bins bins;
+    const bool b_parallel = pool && count >= 2 * kBinChunkSize;
+    if(b_parallel) {
+        parallel_bounds_and_bins(c, first, count, pool, &bounds, &centroid_bounds, &bins);
+    } else {
+        range_bounds(c, first, count, &bounds, &centroid_bounds);
+    }
+
+    node->bounds = bounds;
+    node->first = first;
+    node->count = count;
+
+    if(count <= 1 || depth >= bvh::kMaxDepth - 1)
+        return -1;
+
+    if(!b_parallel)
+        bin_range(c, first, count, centroid_bounds, &bins);
+
+    // find best split plane over all axes
+    int best_axis = -1;
+    int best_bin = 0;
+    Real best_cost = FLT_MAX;
+    const vec3 cmin = centroid_bounds.pmin;
+    const vec3 cext = centroid_bounds.extent();
+
+    for(int axis = 0; axis < 3; ++axis) {
+        if((&cext.x)[axis] <= Real(0))
+            continue;
+        const bin* axis_bins = bins.axes[axis];
+
+        // sweep from the right to get areas and counts of right partitions
+        Real right_area[kNumBins];
+        int right_count[kNumBins];
+        aabb acc;
+        int acc_count = 0;
+        for(int b = kNumBins - 1; b > 0; --b) {
+            acc.grow(axis_bins[b].bounds);
+            acc_count += axis_bins[b].count;
+            right_area[b] = acc.area();
+            right_count[b] = acc_count;
+        }
+
+        acc = aabb();
+        acc_count = 0;
+        for(int b = 0; b < kNumBins - 1; ++b) {
+            acc.grow(axis_bins[b].bounds);
+            acc_count += axis_bins[b].count;
+            if(!acc_count || !right_count[b + 1])
+                continue;
+            Real cost = acc.area() * acc_count + right_area[b + 1] * right_count[b + 1];
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    if(best_axis < 0) {
+        // all centroids coincide, just split in the middle if too many primitives
+        if(count <= c.max_leaf_size)
+            return -1;
+        return first + count / 2;
+    }
+
+    const Real parent_area = bounds.area();
+    const Real split_cost = kTraversalCost + (parent_area > 0 ? best_cost / parent_area : Real(0));
+    if(split_cost >= Real(count) && count <= c.max_leaf_size)
+        return -1;
+
+    const Real k = Real(kNumBins) / (&cext.x)[best_axis];
+    const Real axis_min = (&cmin.x)[best_axis];
+    int32_t* split = std::partition(c.prim_indices + first, c.prim_indices + first + count,
+                                    [&](int32_t prim) {
+        int b = (int)(((&c.centroids[prim].x)[best_axis] - axis_min) * k);
+        return clamp(b, 0, kNumBins - 1) <= best_bin;
+    });
+    return (int)(split - c.prim_indices);
+}
+
+// serial build below node_idx, children are allocated at *next_node
+void build_subtree(const build_context& c, bvh_node* nodes, int32_t node_idx, int first, int count,
+                   int depth, int32_t* next_node) {
+
+    const int mid = split_node(c, &nodes[node_idx], first, count, depth, nullptr);
+    if(mid < 0)
+        return;
+
+    const int32_t left = *next_node;
+    *next_node += 2;
+    nodes[node_idx].first = left;
+    nodes[node_idx].count = 0;
+
+    build_subtree(c, nodes, left, first, mid - first, depth + 1, next_node);
+    build_subtree(c, nodes, left + 1, mid, first + count - mid, depth + 1, next_node);
+}
+
+// Stable LSD radix sort of 30 bit keys together with values. Every chunk
+// scatters to offsets computed up front, so the result does not depend on
+// the number of threads.
+void radix_sort(std::vector<uint32_t>* keys, std::vector<int32_t>* values, thread_pool* pool) {
+    const int n = (int)keys->size();
+    const int num_chunks = (n + kSortChunkSize - 1) / kSortChunkSize;
+    std::vector<uint32_t> tmp_keys(n);
+    std::vector<int32_t> tmp_values(n);
+    // per chunk counts of digits, turned into scatter offsets
+    std::vector<int> offsets((size_t)num_chunks * kRadixBuckets);
+
+    for(int shift = 0; shift < 30; shift += kRadixBits) {
+        const uint32_t* src_keys = keys->data();
+        const int32_t* src_values = values->data();
+        run_tasks(pool, num_chunks, [&](int chunk, int) {
+            int* counts = &offsets[(size_t)chunk * kRadixBuckets];
+            memset(counts, 0, kRadixBuckets * sizeof(int));
+            const int end = min(n, (chunk + 1) * kSortChunkSize);
+            for(int i = chunk * kSortChunkSize; i < end; ++i) {
+                counts[(src_keys[i] >> shift) & (kRadixBuckets - 1)]++;
+            }
+        });
+
+        // digit major, so equal digits keep the order of chunks
+        int sum = 0;
+        for(int b = 0; b < kRadixBuckets; ++b) {
+            for(int chunk = 0; chunk < num_chunks; ++chunk) {
+                int& offs = offsets[(size_t)chunk * kRadixBuckets + b];
+                const int count = offs;
+                offs = sum;
+                sum += count;
+            }
+        }
+
+        run_tasks(pool, num_chunks, [&](int chunk, int) {
+            int* dst = &offsets[(size_t)chunk * kRadixBuckets];
+            const int end = min(n, (chunk + 1) * kSortChunkSize);
+            for(int i = chunk * kSortChunkSize; i < end; ++i) {
+                const int d = dst[(src_keys[i] >> shift) & (kRadixBuckets - 1)]++;
+                tmp_keys[d] = src_keys[i];
+                tmp_values[d] = src_values[i];
+            }
+        });
+        keys->swap(tmp_keys);
+        values->swap(tmp_values);
+    }
+}
+
+// LBVH split of sorted primitives [first, first + count) where the highest
+// differing bit of their Morton codes changes, -1 if the node stays a leaf
+int morton_split(const build_context& c, int first, int count, int depth) {
+    if(count <= c.max_leaf_size || depth >= bvh::kMaxDepth - 1)
+        return -1;
+    const uint32_t code0 = c.codes[first];
+    const uint32_t code1 = c.codes[first + count - 1];
+    // identical codes have no order, just halve them
+    if(code0 == code1)
+        return first + count / 2;
+    const int bit = 31 - __builtin_clz(code0 ^ code1);
+    const uint32_t split_code = (code1 >> bit) << bit;
+    return (int)(std::lower_bound(c.codes + first, c.codes + first + count, split_code) - c.codes);
+}
+
+// serial LBVH build below node_idx, bounds are merged bottom up so every
+// primitive is touched once, returns bounds of the node
+aabb build_subtree_lbvh(const build_context& c, bvh_node* nodes, int32_t node_idx, int first, int count,
+                        int depth, int32_t* next_node) {
+
+    const int mid = morton_split(c, first, count, depth);
+    if(mid < 0) {
+        aabb bounds;
+        for(int i = first; i < first + count; ++i) {
+            bounds.grow(c.prim_bounds[c.prim_indices[i]]);
+        }
+        nodes[node_idx].bounds = bounds;
+        nodes[node_idx].first = first;
+        nodes[node_idx].count = count;
+        return bounds;
+    }
+
+    const int32_t left = *next_node;
+    *next_node += 2;
+    aabb bounds = build_subtree_lbvh(c, nodes, left, first, mid - first, depth + 1, next_node);
+    bounds.grow(build_subtree_lbvh(c, nodes, left + 1, mid, first + count - mid, depth + 1, next_node));
+    nodes[node_idx].bounds = bounds;
+    nodes[node_idx].first = left;
+    nodes[node_idx].count = 0;
+    return bounds;
+}
+
+// per job state of build_bvhs()
+struct job_state {
+    std::vector<vec3> centroids;
+    std::vector<int32_t> prim_indices;
+    // LBVH only, sorted along with prim_indices
+    std::vector<uint32_t> codes;
+    // preallocated for the worst case of one primitive per leaf
+    std::vector<bvh_node> nodes;
+    // nodes without gaps between subtrees, moved to the hierarchy at the end
+    std::vector<bvh_node> compacted;
+    // nodes split before subtree tasks start
+    int32_t num_top_nodes = 0;
+};
+
+}
+
+const char* bvh_build_method_name(bvh_build_method method) {
+    return method == kBvhBuildLBVH ? "lbvh" : "sah";
+}
+
+bool parse_bvh_build_method(const char* name, bvh_build_method* method) {
+    if(!strcmp(name, "sah")) {
+        *method = kBvhBuildSAH;
+        return true;
+    }
+    if(!strcmp(name, "lbvh")) {
+        *method = kBvhBuildLBVH;
+        return true;
+    }
+    return false;
+}
+
+void bvh::build(const aabb* prim_bounds, int num_prims, int max_leaf, bvh_build_method method) {
+
+    const bvh_build_job job = { this, prim_bounds, num_prims, max_leaf, method };
+    build_bvhs(&job, 1, nullptr);
+}
+
+void build_bvhs(const bvh_build_job* jobs, int num_jobs, thread_pool* pool) {
+
+    std::vector<job_state> states(num_jobs);
+    int64_t total_prims = 0;
+    for(int j=0; j<num_jobs; ++j) {
+        total_prims += jobs[j].num_prims;
+    }
+
+    // nodes with more primitives than this are split before subtree tasks
+    // start, so there are enough tasks to keep every thread busy
+    const int num_threads = pool ? pool->get_num_threads() : 1;
+    const int64_t subtree_size = num_threads > 1 ?
+        max((int64_t)kMinSubtreeSize, total_prims / (8 * num_threads)) : INT32_MAX;
+
+    std::vector<subtree_task> tasks;
+    for(int j=0; j<num_jobs; ++j) {
+        const bvh_build_job& job = jobs[j];
+        job_state& st = states[j];
+        job.accel->clear();
+        job.accel->max_leaf_size = job.max_leaf_size;
+        job.accel->build_method = job.method;
+        if(job.num_prims <= 0)
+            continue;
+
+        st.centroids.resize(job.num_prims);
+        st.prim_indices.resize(job.num_prims);
+        aabb centroid_bounds;
+        for(int i=0; i<job.num_prims; ++i) {
+            st.centroids[i] = job.prim_bounds[i].center();
+            st.prim_indices[i] = i;
+            centroid_bounds.grow(st.centroids[i]);
+        }
+        st.nodes.resize(2 * (size_t)job.num_prims - 1);
+
+        const bool b_lbvh = job.method == kBvhBuildLBVH;
+        if(b_lbvh) {
+            st.codes.resize(job.num_prims);
+            run_tasks(pool, (job.num_prims + kSortChunkSize - 1) / kSortChunkSize, [&](int chunk, int) {
+                const int end = min(job.num_prims, (chunk + 1) * kSortChunkSize);
+                for(int i = chunk * kSortChunkSize; i < end; ++i) {
+                    st.codes[i] = morton_code(st.centroids[i], centroid_bounds);
+                }
+            });
+            radix_sort(&st.codes, &st.prim_indices, pool);
+        }
+
+        const build_context c = { job.prim_bounds, st.centroids.data(), st.prim_indices.data(),
+                                  job.max_leaf_size, b_lbvh ? st.codes.data() : nullptr };
+
+        // split big nodes breadth first, everything small enough becomes a task
+        struct pending { int32_t node; int first; int count; int depth; };
+        std::vector<pending> queue = { { 0, 0, job.num_prims, 0 } };
+        int32_t next_node = 1;
+        for(size_t q = 0; q < queue.size(); ++q) {
+            const pending n = queue[q];
+            if(n.count <= subtree_size) {
+                tasks.push_back({ j, n.node, n.first, n.count, n.depth, 0, 0 });
+                continue;
+            }
+            int mid;
+            if(b_lbvh) {
+                // bounds of LBVH nodes are merged once subtrees are done
+                mid = morton_split(c, n.first, n.count, n.depth);
+                if(mid < 0) {
+                    build_subtree_lbvh(c, st.nodes.data(), n.node, n.first, n.count, n.depth, &next_node);
+                    continue;
+                }
+            } else {
+                mid = split_node(c, &st.nodes[n.node], n.first, n.count, n.depth, pool);
+                if(mid < 0)
+                    continue;
+            }
+            const int32_t left = next_node;
+            next_node += 2;
+            st.nodes[n.node].first = left;
+            st.nodes[n.node].count = 0;
+            queue.push_back({ left, n.first, mid - n.first, n.depth + 1 });
+            queue.push_back({ left + 1, mid, n.first + n.count - mid, n.depth + 1 });
+        }
+        st.num_top_nodes = next_node;
+    }
+
+    // Node ranges of tasks follow top nodes of their job, a subtree of n
+    // primitives has at most 2n - 2 nodes below its root.
+    std::vector<int32_t> next_base(num_jobs);
+    for(int j=0; j<num_jobs; ++j) {
+        next_base[j] = states[j].num_top_nodes;
+    }
+    for(subtree_task& t: tasks) {
+        t.base = next_base[t.job];
+        next_base[t.job] += 2 * t.count - 2;
+    }
+
+    run_tasks(pool, (int)tasks.size(), [&](int i, int) {
+        subtree_task& t = tasks[i];
+        job_state& st = states[t.job];
+        const build_context c = { jobs[t.job].prim_bounds, st.centroids.data(), st.prim_indices.data(),
+                                  jobs[t.job].max_leaf_size, st.codes.empty() ? nullptr : st.codes.data() };
+        int32_t next_node = t.base;
+        if(c.codes)
+            build_subtree_lbvh(c, st.nodes.data(), t.root, t.first, t.count, t.depth, &next_node);
+        else
+            build_subtree(c, st.nodes.data(), t.root, t.first, t.count, t.depth, &next_node);
+        t.num_nodes = next_node - t.base;
+    });
+
+    // top LBVH nodes get bounds of their children, which always come later
+    for(int j=0; j<num_jobs; ++j) {
+        job_state& st = states[j];
+        if(jobs[j].method != kBvhBuildLBVH)
+            continue;
+        for(int32_t k = st.num_top_nodes - 1; k >= 0; --k) {
+            bvh_node& n = st.nodes[k];
+            if(n.is_leaf())
+                continue;
+            n.bounds = st.nodes[n.first].bounds;
+            n.bounds.grow(st.nodes[n.first + 1].bounds);
+        }
+    }
+
+    // close gaps left by tasks which needed fewer nodes than reserved
+    std::vector<int32_t> compact_base(num_jobs);
+    for(int j=0; j<num_jobs; ++j) {
+        compact_base[j] = states[j].num_top_nodes;
+    }
+    std::vector<int32_t> task_offset(tasks.size());
+    for(size_t i=0; i<tasks.size(); ++i) {
+        task_offset[i] = compact_base[tasks[i].job] - tasks[i].base;
+        compact_base[tasks[i].job] += tasks[i].num_nodes;
+    }
+    for(int j=0; j<num_jobs; ++j) {
+        job_state& st = states[j];
+        if(jobs[j].num_prims > 0)
+            st.compacted.resize(compact_base[j]);
+        std::copy(st.nodes.begin(), st.nodes.begin() + st.num_top_nodes, st.compacted.begin());
+    }
+
+    auto compact_task = [&](int i, int) {
+        const subtree_task& t = tasks[i];
+        const int32_t offset = task_offset[i];
+        std::vector<bvh_node>& dst = states[t.job].compacted;
+        const bvh_node* src = states[t.job].nodes.data();
+        for(int32_t k = t.base; k < t.base + t.num_nodes; ++k) {
+            bvh_node n = src[k];
+            if(!n.is_leaf())
+                n.first += offset;
+            dst[k + offset] = n;
+        }
+        if(!dst[t.root].is_leaf())
+            dst[t.root].first += offset;
+    };
+
+    auto finish_job = [&](int j, int) {
+        if(jobs[j].num_prims <= 0)
+            return;
+        states[j].nodes = std::vector<bvh_node>();
+        jobs[j].accel->nodes = std::move(states[j].compacted);
+        jobs[j].accel->prim_indices = std::move(states[j].prim_indices);
+        jobs[j].accel->collapse_wide();
+        jobs[j].accel->built_cost = jobs[j].accel->sah_cost();
+    };
+
+    run_tasks(pool, (int)tasks.size(), compact_task);
+    run_tasks(pool, num_jobs, finish_job);
+}
+
+void bvh::refit(const aabb* prim_bounds) {
+
+    if(nodes.empty())
+        return;
+    // copied out of the mesh cache file on the first refit
+    std::vector<bvh_node> refitted = nodes.take();
+    refit_recursive(refitted.data(), 0, prim_bounds);
+    nodes = std::move(refitted);
+    collapse_wide();
+}
+
+void bvh::refit_recursive(bvh_node* refitted, int32_t node_idx, const aabb* prim_bounds) const {
+
+    bvh_node& n = refitted[node_idx];
+    aabb bounds;
+    if(n.is_leaf()) {
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            bounds.grow(prim_bounds[prim_indices[i]]);
+        }
+    } else {
+        refit_recursive(refitted, n.first, prim_bounds);
+        refit_recursive(refitted, n.first + 1, prim_bounds);
+        bounds = refitted[n.first].bounds;
+        bounds.grow(refitted[n.first + 1].bounds);
+    }
+    n.bounds = bounds;
+}
+
+Real bvh::sah_cost() const {
+
+    if(nodes.empty() || nodes[0].bounds.area() <= 0)
+        return 0;
+
+    double cost = 0;
+    for(const bvh_node& n: nodes) {
+        cost += (double)n.bounds.area() * (n.is_leaf() ? (double)n.count : (double)kTraversalCost);
+    }
+    return (Real)(cost / nodes[0].bounds.area());
+}
+
+void bvh::collapse_wide() {
+
+    wide_nodes.clear();
+    if(nodes.empty())
+        return;
+    wide_nodes.reserve(nodes.size() / 2 + 1);
+    wide_root = collapse_recursive(0);
+}
+
+int32_t bvh::collapse_recursive(int32_t node_idx) {
+
+    if(nodes[node_idx].is_leaf())
+        return ~node_idx;
+
+    // pull grandchildren up, always opening the inner child with the largest
+    // surface area, until there are 4 children or only leafs left
+    int32_t children[4] = { nodes[node_idx].first, nodes[node_idx].first + 1 };
+    int num_children = 2;
+    while(num_children < 4) {
+        int best = -1;
+        Real best_area = -1;
+        for(int i=0; i<num_children; ++i) {
+            const bvh_node& c = nodes[children[i]];
+            if(!c.is_leaf() && c.bounds.area() > best_area) {
+                best_area = c.bounds.area();
+                best = i;
+            }
+        }
+        if(best < 0)
+            break;
+        const int32_t opened = children[best];
+        children[best] = nodes[opened].first;
+        children[num_children++] = nodes[opened].first + 1;
+    }
+
+    const int32_t wide_idx = (int32_t)wide_nodes.size();
+    wide_nodes.emplace_back();
+    for(int i=0; i<4; ++i) {
+        // unused slots get an empty box, they are masked out by num_children anyway
+        const aabb b = i < num_children ? nodes[children[i]].bounds : aabb();
+        bvh4_node& wn = wide_nodes[wide_idx];
+        wn.bmin_x[i] = b.pmin.x; wn.bmin_y[i] = b.pmin.y; wn.bmin_z[i] = b.pmin.z;
+        wn.bmax_x[i] = b.pmax.x; wn.bmax_y[i] = b.pmax.y; wn.bmax_z[i] = b.pmax.z;
+        wn.child[i] = 0;
+    }
+    wide_nodes[wide_idx].num_children = num_children;
+
+    for(int i=0; i<num_children; ++i) {
+        const int32_t child_ref = collapse_recursive(children[i]);
+        wide_nodes[wide_idx].child[i] = child_ref;
+    }
+    return wide_idx;
+}
+
@@ -0,0 +1,457 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+#include "ray.h"
+#include "aabb.h"
+#include "ray_packet.h"
+#include "mapped_file.h"
+
+#include <vector>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct bvh_node {
+    aabb bounds;
+    // inner node: index of the left child, right child is always first + 1
+    // leaf: index of the first primitive in bvh::prim_indices
+    int32_t first;
+    // number of primitives, 0 for inner nodes
+    int32_t count;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// 4 wide node collapsed from the binary hierarchy. Child bounds are stored as
+// structure of arrays so that all of them are tested with one SIMD slab test.
+struct bvh4_node {
+    float bmin_x[4], bmin_y[4], bmin_z[4];
+    float bmax_x[4], bmax_y[4], bmax_z[4];
+    // >= 0: index of a wide node, < 0: ~index of a leaf in binary nodes
+    int32_t child[4];
+    int32_t num_children;
+};
+
+class bvh;
+
+// Binned SAH gives trees which are faster to trace, linear BVH (primitives
+// sorted by Morton codes of their centroids) builds several times faster,
+// e.g. for previews.
+enum bvh_build_method { kBvhBuildSAH, kBvhBuildLBVH };
+
+const char* bvh_build_method_name(bvh_build_method method);
+// accepts "sah" and "lbvh"
+bool parse_bvh_build_method(const char* name, bvh_build_method* method);
+
+// One hierarchy to be built by build_bvhs()
+struct bvh_build_job {
+    bvh* accel;
+    const aabb* prim_bounds;
+    int num_prims;
+    int max_leaf_size;
+    bvh_build_method method;
+};
+
+// Builds hierarchies of all jobs at once, giving the same trees as
+// bvh::build(). Nodes near the roots of big jobs are split one at a time with
+// binning (or Morton code sorting for LBVH) spread over the pool, the
+// remaining subtrees of all jobs are then built in parallel, each into its
+// own range of a preallocated node array. Runs serially if pool is null.
+void build_bvhs(const bvh_build_job* jobs, int num_jobs, class thread_pool* pool);
+
+class bvh {
+  public:
+    static const int kMaxDepth = 64;
+    static const int kMaxLeafSize = 4;
+    // refitted trees slower than this relative to a fresh build are rebuilt
+    static constexpr Real kMaxRefitCostRatio = Real(1.5);
+
+    // builds hierarchy using binned surface area heuristic, leafs with up to
+    // max_leaf_size primitives are not split further if SAH says so, LBVH
+    // splits until leafs have at most max_leaf_size primitives
+    void build(const aabb* prim_bounds, int num_prims, int max_leaf_size = kMaxLeafSize,
+               bvh_build_method method = kBvhBuildSAH);
+    friend void build_bvhs(const bvh_build_job* jobs, int num_jobs, class thread_pool* pool);
+    void clear() { nodes.clear(); prim_indices.clear(); }
+    // takes hierarchy built earlier, mapped from mesh cache or renumbered
+    void set_data(mapped_array<bvh_node>&& n, mapped_array<int32_t>&& prims, bvh_build_method method) {
+        nodes = std::move(n);
+        prim_indices = std::move(prims);
+        build_method = method;
+        collapse_wide();
+        built_cost = sah_cost();
+    }
+    bvh_build_method get_build_method() const { return build_method; }
+    // Recomputes node bounds bottom up after primitives moved, prim_bounds
+    // are indexed like in build(). Topology is kept, so the tree gets slower
+    // to trace the more primitives move relative to each other.
+    void refit(const aabb* prim_bounds);
+    // surface area heuristic cost of the tree relative to the cost it had
+    // when it was built, grows with every refit which spreads nodes apart
+    Real get_refit_cost_ratio() const {
+        return built_cost > 0 ? sah_cost() / built_cost : Real(1);
+    }
+    bool empty() const { return nodes.empty(); }
+
+    const aabb& get_bounds() const { return nodes[0].bounds; }
+    const mapped_array<bvh_node>& get_nodes() const { return nodes; }
+    const mapped_array<int32_t>& get_prim_indices() const { return prim_indices; }
+    const std::vector<bvh4_node>& get_wide_nodes() const { return wide_nodes; }
+
+    // Walks nodes front to back, leaf_fn(prim_index, t_max) is called for each
+    // primitive in a visited leaf and should return true (and shrink t_max)
+    // when it finds a closer hit.
+    template <typename LEAF_FN>
+    bool intersect(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+
+    // Any hit query, leaf_fn(prim_index) returns true if the primitive blocks
+    // the ray and traversal stops right there.
+    template <typename LEAF_FN>
+    bool occluded(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+
+    // Same as above but leaf_fn gets index of the visited leaf node instead
+    // of its primitives, for callers which keep own per leaf data. Both walk
+    // the 4 wide hierarchy.
+    template <typename LEAF_FN>
+    bool intersect_leaves(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+    template <typename LEAF_FN>
+    bool occluded_leaves(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+
+    // Closest hit for rays [first, end) of a packet, rays outside of the range
+    // are known to miss the hierarchy. Walks binary nodes keeping the range
+    // from the first to the last ray which hit the current node,
+    // leaf_fn(node_idx, first, end) has to test rays of the range and shrink
+    // their t_max on hits.
+    template <typename LEAF_FN>
+    void intersect_packet(ray_packet& p, int first, int end, Real t_min, LEAF_FN&& leaf_fn) const;
+
+    // same over the binary nodes, kept for comparison in bvh_bench
+    template <typename LEAF_FN>
+    bool intersect_leaves_binary(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+    template <typename LEAF_FN>
+    bool occluded_leaves_binary(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const;
+
+  private:
+    // (re)creates wide_nodes from nodes
+    void collapse_wide();
+    int32_t collapse_recursive(int32_t node_idx);
+    void refit_recursive(bvh_node* refitted, int32_t node_idx, const aabb* prim_bounds) const;
+    // expected cost of a ray which hits the root
+    Real sah_cost() const;
+
+    // mapped from mesh cache or owned
+    mapped_array<bvh_node> nodes;
+    mapped_array<int32_t> prim_indices;
+    int max_leaf_size = kMaxLeafSize;
+    bvh_build_method build_method = kBvhBuildSAH;
+    Real built_cost = 0;
+
+    std::vector<bvh4_node> wide_nodes;
+    // wide node index or ~binary leaf index if whole tree is a single leaf
+    int32_t wide_root = 0;
+};
+
+template <typename LEAF_FN>
+bool bvh::intersect(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    return intersect_leaves(r, t_min, t_max, [&](int32_t node_idx, Real& t_closest) {
+        const bvh_node& n = nodes[node_idx];
+        bool b_hit = false;
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            b_hit |= leaf_fn(prim_indices[i], t_closest);
+        }
+        return b_hit;
+    });
+}
+
+template <typename LEAF_FN>
+bool bvh::occluded(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    return occluded_leaves(r, t_min, t_max, [&](int32_t node_idx) {
+        const bvh_node& n = nodes[node_idx];
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            if(leaf_fn(prim_indices[i]))
+                return true;
+        }
+        return false;
+    });
+}
+
+// Slab test of a ray against all children of a wide node, returns bit mask of
+// children hit and their entry distances. Same math as ray_aabb_intersect.
+INLINE int ray_aabb4_intersect(const bvh4_node& n, const vec3& orig, const vec3& inv_dir,
+                               Real t_min, Real t_max, float t_entry[4]) {
+#if defined(__SSE2__)
+    const __m128 ox = _mm_set1_ps((float)orig.x), oy = _mm_set1_ps((float)orig.y), oz = _mm_set1_ps((float)orig.z);
+    const __m128 ix = _mm_set1_ps((float)inv_dir.x), iy = _mm_set1_ps((float)inv_dir.y), iz = _mm_set1_ps((float)inv_dir.z);
+
+    const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmin_x), ox), ix);
+    const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmax_x), ox), ix);
+    const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmin_y), oy), iy);
+    const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmax_y), oy), iy);
+    const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmin_z), oz), iz);
+    const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.bmax_z), oz), iz);
+
+    const __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                                 _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps((float)t_min)));
+    const __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                                 _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps((float)t_max)));
+    _mm_storeu_ps(t_entry, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << n.num_children) - 1);
+#else
+    int mask = 0;
+    for(int i=0; i<n.num_children; ++i) {
+        const aabb b(vec3(n.bmin_x[i], n.bmin_y[i], n.bmin_z[i]), vec3(n.bmax_x[i], n.bmax_y[i], n.bmax_z[i]));
+        Real t;
+        if(ray_aabb_intersect(orig, inv_dir, b, t_min, t_max, &t))
+            mask |= 1 << i;
+        t_entry[i] = (float)t;
+    }
+    return mask;
+#endif
+}
+
+template <typename LEAF_FN>
+bool bvh::intersect_leaves(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    if(nodes.empty())
+        return false;
+
+    const vec3 orig = r.origin();
+    const vec3 inv_dir = inv_direction(r.direction());
+
+    Real t_entry;
+    if(!ray_aabb_intersect(orig, inv_dir, nodes[0].bounds, t_min, t_max, &t_entry))
+        return false;
+
+    struct stack_entry {
+        int32_t node;
+        Real t_entry;
+    };
+    // every visited level pushes at most 3 children
+    stack_entry stack[3 * kMaxDepth];
+    int sp = 0;
+
+    bool b_hit = false;
+    int32_t node_ref = wide_root;
+    while(true) {
+        if(node_ref < 0) {
+            b_hit |= leaf_fn(~node_ref, t_max);
+        } else {
+            const bvh4_node& n = wide_nodes[node_ref];
+            float t_child[4];
+            int mask = ray_aabb4_intersect(n, orig, inv_dir, t_min, t_max, t_child);
+            if(mask) {
+                // sort hit children by entry distance, push all but the closest
+                // one far to near
+                int order[4];
+                int num_hit = 0;
+                for(int i=0; i<4; ++i) {
+                    if(!(mask & (1 << i)))
+                        continue;
+                    int j = num_hit++;
+                    for(; j > 0 && t_child[order[j - 1]] <= t_child[i]; --j) {
+                        order[j] = order[j - 1];
+                    }
+                    order[j] = i;
+                }
+                for(int i=0; i<num_hit - 1; ++i) {
+                    stack[sp++] = { n.child[order[i]], t_child[order[i]] };
+                }
+                node_ref = n.child[order[num_hit - 1]];
+                continue;
+            }
+        }
+
+        // pop next node skipping those which are further than the closest hit
+        do {
+            if(!sp)
+                return b_hit;
+            --sp;
+        } while(stack[sp].t_entry > t_max);
+        node_ref = stack[sp].node;
+    }
+}
+
+template <typename LEAF_FN>
+bool bvh::occluded_leaves(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    if(nodes.empty())
+        return false;
+
+    const vec3 orig = r.origin();
+    const vec3 inv_dir = inv_direction(r.direction());
+
+    Real t_entry;
+    if(!ray_aabb_intersect(orig, inv_dir, nodes[0].bounds, t_min, t_max, &t_entry))
+        return false;
+
+    // order does not matter as we stop on the first hit, so no sorting
+    int32_t stack[3 * kMaxDepth];
+    int sp = 0;
+    int32_t node_ref = wide_root;
+    while(true) {
+        if(node_ref < 0) {
+            if(leaf_fn(~node_ref))
+                return true;
+        } else {
+            const bvh4_node& n = wide_nodes[node_ref];
+            float t_child[4];
+            int mask = ray_aabb4_intersect(n, orig, inv_dir, t_min, t_max, t_child);
+            if(mask) {
+                int i = __builtin_ctz(mask);
+                node_ref = n.child[i];
+                for(mask &= mask - 1; mask; mask &= mask - 1) {
+                    stack[sp++] = n.child[__builtin_ctz(mask)];
+                }
+                continue;
+            }
+        }
+
+        if(!sp)
+            return false;
+        node_ref = stack[--sp];
+    }
+}
+
+template <typename LEAF_FN>
+bool bvh::intersect_leaves_binary(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    if(nodes.empty())
+        return false;
+
+    const vec3 orig = r.origin();
+    const vec3 inv_dir = inv_direction(r.direction());
+
+    Real t_entry;
+    if(!ray_aabb_intersect(orig, inv_dir, nodes[0].bounds, t_min, t_max, &t_entry))
+        return false;
+
+    struct stack_entry {
+        int32_t node;
+        Real t_entry;
+    };
+    stack_entry stack[kMaxDepth];
+    int sp = 0;
+
+    bool b_hit = false;
+    int32_t node_idx = 0;
+    while(true) {
+        const bvh_node& n = nodes[node_idx];
+        if(n.is_leaf()) {
+            b_hit |= leaf_fn(node_idx, t_max);
+        } else {
+            Real t0, t1;
+            bool b_hit0 = ray_aabb_intersect(orig, inv_dir, nodes[n.first].bounds, t_min, t_max, &t0);
+            bool b_hit1 = ray_aabb_intersect(orig, inv_dir, nodes[n.first + 1].bounds, t_min, t_max, &t1);
+            if(b_hit0 && b_hit1) {
+                // visit closer child first, push the other one
+                if(t1 < t0) {
+                    stack[sp++] = { n.first, t0 };
+                    node_idx = n.first + 1;
+                } else {
+                    stack[sp++] = { n.first + 1, t1 };
+                    node_idx = n.first;
+                }
+                continue;
+            } else if(b_hit0) {
+                node_idx = n.first;
+                continue;
+            } else if(b_hit1) {
+                node_idx = n.first + 1;
+                continue;
+            }
+        }
+
+        // pop next node skipping those which are further than the closest hit
+        do {
+            if(!sp)
+                return b_hit;
+            --sp;
+        } while(stack[sp].t_entry > t_max);
+        node_idx = stack[sp].node;
+    }
+}
+
+template <typename LEAF_FN>
+bool bvh::occluded_leaves_binary(const ray &r, Real t_min, Real t_max, LEAF_FN&& leaf_fn) const {
+
+    if(nodes.empty())
+        return false;
+
+    const vec3 orig = r.origin();
+    const vec3 inv_dir = inv_direction(r.direction());
+
+    Real t_entry;
+    if(!ray_aabb_intersect(orig, inv_dir, nodes[0].bounds, t_min, t_max, &t_entry))
+        return false;
+
+    int32_t stack[kMaxDepth];
+    int sp = 0;
+    int32_t node_idx = 0;
+    while(true) {
+        const bvh_node& n = nodes[node_idx];
+        if(n.is_leaf()) {
+            if(leaf_fn(node_idx))
+                return true;
+        } else {
+            Real t0, t1;
+            bool b_hit0 = ray_aabb_intersect(orig, inv_dir, nodes[n.first].bounds, t_min, t_max, &t0);
+            bool b_hit1 = ray_aabb_intersect(orig, inv_dir, nodes[n.first + 1].bounds, t_min, t_max, &t1);
+            if(b_hit0) {
+                if(b_hit1)
+                    stack[sp++] = n.first + 1;
+                node_idx = n.first;
+                continue;
+            } else if(b_hit1) {
+                node_idx = n.first + 1;
+                continue;
+            }
+        }
+
+        if(!sp)
+            return false;
+        node_idx = stack[--sp];
+    }
+}
+
+template <typename LEAF_FN>
+void bvh::intersect_packet(ray_packet& p, int first, int end, Real t_min, LEAF_FN&& leaf_fn) const {
+
+    if(nodes.empty())
+        return;
+
+    // nodes are tested when popped so that hits found meanwhile cull them
+    struct stack_entry {
+        int32_t node;
+        int16_t first;
+        int16_t end;
+    };
+    stack_entry stack[kMaxDepth + 2];
+    int sp = 0;
+    stack[sp++] = { 0, (int16_t)first, (int16_t)end };
+
+    while(sp) {
+        --sp;
+        const int32_t node_idx = stack[sp].node;
+        const bvh_node& n = nodes[node_idx];
+        int node_first = stack[sp].first;
+        int node_end = stack[sp].end;
+        if(!packet_clip_range(p, n.bounds, t_min, &node_first, &node_end))
+            continue;
+
+        if(n.is_leaf()) {
+            leaf_fn(node_idx, node_first, node_end);
+            continue;
+        }
+
+        // push the far child first, which one is nearer is decided by the
+        // first active ray
+        const vec3 d = nodes[n.first + 1].bounds.center() - nodes[n.first].bounds.center();
+        const bool b_right_first = d.x * p.dx[node_first] + d.y * p.dy[node_first] + d.z * p.dz[node_first] < 0;
+        stack[sp++] = { b_right_first ? n.first : n.first + 1, (int16_t)node_first, (int16_t)node_end };
+        stack[sp++] = { b_right_first ? n.first + 1 : n.first, (int16_t)node_first, (int16_t)node_end };
+    }
+}
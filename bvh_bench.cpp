@@ -0,0 +1,228 @@
+// Compares traversal of the binary and the 4 wide BVH layouts on the same
+// tree and single rays with packets for coherent primary rays,
+// usage: bvh_bench [mesh.obj] [num rays]
+#include "config.h"
+#include "vec.h"
+#include "rng.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "camera.h"
+#include "obj_loader.h"
+#include "simd_dispatch.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+std::vector<mesh_triangle> make_triangles(const ObjFile* obj) {
+    std::vector<mesh_triangle> tris(obj->faces.size() / 3);
+    for(size_t i=0; i<tris.size(); ++i) {
+        const vec3 v0 = obj->p[obj->faces[3*i + 0].p - 1];
+        tris[i].v0 = v0;
+        tris[i].e1 = obj->p[obj->faces[3*i + 1].p - 1] - v0;
+        tris[i].e2 = obj->p[obj->faces[3*i + 2].p - 1] - v0;
+    }
+    return tris;
+}
+
+// random soup of small triangles in a unit cube when no mesh is given
+ObjFile* make_random_obj(int count) {
+    rng gen(1, 1);
+    std::vector<vec3> p;
+    std::vector<ObjVertexId> faces;
+    for(int i=0; i<count; ++i) {
+        const vec3 v0 = random_vector(gen, -1, 1);
+        p.push_back(v0);
+        p.push_back(v0 + 0.02f * random_vector(gen, -1, 1));
+        p.push_back(v0 + 0.02f * random_vector(gen, -1, 1));
+        for(int k=0; k<3; ++k) {
+            faces.push_back(ObjVertexId(3*i + k + 1, 0));
+        }
+    }
+    ObjFile* obj = new ObjFile;
+    obj->p = std::move(p);
+    obj->faces = std::move(faces);
+    return obj;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+}
+
+int main(int argc, char** argv) {
+
+    select_simd_isa(detect_simd_isa());
+    printf("%s kernels\n", simd_isa_name(get_simd_isa()));
+
+    ObjFile* obj = nullptr;
+    if(argc > 1) {
+        obj = load_obj_from_file(argv[1]);
+        if(!obj) {
+            printf("Failed to load obj model from: %s\n", argv[1]);
+            return -1;
+        }
+    } else {
+        obj = make_random_obj(1 << 20);
+    }
+    const std::vector<mesh_triangle> tris = make_triangles(obj);
+    const int num_rays = argc > 2 ? atoi(argv[2]) : 1 << 20;
+
+    std::vector<aabb> bounds(tris.size());
+    for(size_t i=0; i<tris.size(); ++i) {
+        bounds[i].grow(tris[i].v0);
+        bounds[i].grow(tris[i].v0 + tris[i].e1);
+        bounds[i].grow(tris[i].v0 + tris[i].e2);
+    }
+
+    bvh accel;
+    auto t0 = std::chrono::steady_clock::now();
+    accel.build(bounds.data(), (int)bounds.size(), kTriBlockWidth);
+    printf("%d triangles, build %.3f s, %d binary nodes, %d wide nodes\n", (int)tris.size(),
+           seconds_since(t0), (int)accel.get_nodes().size(), (int)accel.get_wide_nodes().size());
+
+    {
+        thread_pool pool(thread_pool::default_num_threads());
+        bvh parallel_accel;
+        for(bvh_build_method method: { kBvhBuildSAH, kBvhBuildLBVH }) {
+            const bvh_build_job job = { &parallel_accel, bounds.data(), (int)bounds.size(), kTriBlockWidth, method };
+            t0 = std::chrono::steady_clock::now();
+            build_bvhs(&job, 1, &pool);
+            printf("parallel %s build on %d threads %.3f s, %d binary nodes\n", bvh_build_method_name(method),
+                   pool.get_num_threads(), seconds_since(t0), (int)parallel_accel.get_nodes().size());
+        }
+    }
+
+    // rays from a sphere around the mesh towards random points inside it
+    const aabb& scene_bounds = accel.get_bounds();
+    const vec3 center = scene_bounds.center();
+    const Real radius = length(scene_bounds.extent());
+    std::vector<ray> rays(num_rays);
+    rng gen(7, 7);
+    for(auto& r: rays) {
+        const vec3 from = center + radius * random_unit_vector(gen);
+        const vec3 e = scene_bounds.extent();
+        const vec3 to = scene_bounds.pmin + vec3(e.x * random_Real(gen), e.y * random_Real(gen), e.z * random_Real(gen));
+        r = ray(from, normalize(to - from));
+    }
+
+    const mapped_array<bvh_node>& nodes = accel.get_nodes();
+    const mapped_array<int32_t>& prims = accel.get_prim_indices();
+    auto closest_leaf = [&](const ray& r, int32_t node_idx, Real& t_max) {
+        bool b_hit = false;
+        const bvh_node& n = nodes[node_idx];
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            Real t, u, v;
+            if(ray_tri_intersect(r.orig, r.dir, tris[prims[i]], 0, t_max, &t, &u, &v)) {
+                t_max = t;
+                b_hit = true;
+            }
+        }
+        return b_hit;
+    };
+    auto any_leaf = [&](const ray& r, int32_t node_idx) {
+        const bvh_node& n = nodes[node_idx];
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            Real t, u, v;
+            if(ray_tri_intersect(r.orig, r.dir, tris[prims[i]], 0, Real(1e30), &t, &u, &v))
+                return true;
+        }
+        return false;
+    };
+
+    for(int wide = 0; wide < 2; ++wide) {
+        int num_hits = 0;
+        double t_sum = 0;
+        t0 = std::chrono::steady_clock::now();
+        for(const ray& r: rays) {
+            Real t_hit = Real(1e30);
+            auto leaf_fn = [&](int32_t node_idx, Real& t_max) {
+                bool b_hit = closest_leaf(r, node_idx, t_max);
+                if(b_hit) t_hit = t_max;
+                return b_hit;
+            };
+            bool b_hit = wide ? accel.intersect_leaves(r, 0, Real(1e30), leaf_fn)
+                              : accel.intersect_leaves_binary(r, 0, Real(1e30), leaf_fn);
+            if(b_hit) {
+                num_hits++;
+                t_sum += t_hit;
+            }
+        }
+        const double closest_time = seconds_since(t0);
+
+        int num_occluded = 0;
+        t0 = std::chrono::steady_clock::now();
+        for(const ray& r: rays) {
+            auto leaf_fn = [&](int32_t node_idx) { return any_leaf(r, node_idx); };
+            num_occluded += wide ? accel.occluded_leaves(r, 0, Real(1e30), leaf_fn)
+                                 : accel.occluded_leaves_binary(r, 0, Real(1e30), leaf_fn);
+        }
+        const double any_time = seconds_since(t0);
+
+        printf("%-6s closest: %7.2f Mrays/s (%d hits, t sum %.3f)  any: %7.2f Mrays/s (%d hits)\n",
+               wide ? "bvh4" : "binary", num_rays / closest_time * 1e-6, num_hits, t_sum,
+               num_rays / any_time * 1e-6, num_occluded);
+    }
+
+    // coherent primary rays of a pinhole camera looking at the mesh from the
+    // front, traced one by one and in packets
+    const int res = 512;
+    const Real oo_res = Real(1) / Real(res - 1);
+    const camera cam(center + vec3(0, 0, radius), center, vec3(0, 1, 0), Real(60), Real(1), Real(0), Real(1));
+    // owns obj from here on
+    std::shared_ptr<const ObjFile> shared_obj(obj);
+    mesh m(shared_obj);
+    mesh* mesh_ptr = &m;
+    mesh::build_accels(&mesh_ptr, 1, nullptr, kBvhBuildSAH);
+
+    int num_hits = 0;
+    double t_sum = 0;
+    t0 = std::chrono::steady_clock::now();
+    for(int j=0; j<res; ++j) {
+        for(int i=0; i<res; ++i) {
+            rng gen = rng::for_pixel(i, j, 0);
+            hit_info rec;
+            if(m.hit(cam.get_ray(Real(i) * oo_res, Real(j) * oo_res, gen), 0, Real(1e30), rec)) {
+                num_hits++;
+                t_sum += rec.t;
+            }
+        }
+    }
+    const double single_time = seconds_since(t0);
+
+    int num_packet_hits = 0;
+    double packet_t_sum = 0;
+    ray_packet packet;
+    Real us[kPacketSize], vs[kPacketSize];
+    t0 = std::chrono::steady_clock::now();
+    for(int by=0; by<res; by += kPacketDim) {
+        for(int bx=0; bx<res; bx += kPacketDim) {
+            for(int k=0; k<kPacketSize; ++k) {
+                us[k] = Real(bx + k % kPacketDim) * oo_res;
+                vs[k] = Real(by + k / kPacketDim) * oo_res;
+            }
+            cam.get_packet(us, vs, kPacketSize, &packet);
+            packet.reset_hits(Real(1e30));
+            m.intersect_packet(packet, 0, kPacketSize, 0, 0);
+            for(int k=0; k<kPacketSize; ++k) {
+                if(packet.obj[k] >= 0) {
+                    num_packet_hits++;
+                    packet_t_sum += packet.t_max[k];
+                }
+            }
+        }
+    }
+    const double packet_time = seconds_since(t0);
+
+    printf("primary single: %7.2f Mrays/s (%d hits, t sum %.3f)\n",
+           res * res / single_time * 1e-6, num_hits, t_sum);
+    printf("primary packet: %7.2f Mrays/s (%d hits, t sum %.3f)\n",
+           res * res / packet_time * 1e-6, num_packet_hits, packet_t_sum);
+
+    return 0;
+}
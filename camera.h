@@ -3,6 +3,7 @@
 #include "config.h"
 #include "vec.h"
 #include "ray.h"
+#include "ray_packet.h"
 
 class camera {
   public:
@@ -27,14 +28,28 @@ class camera {
         lens_radius = aperture / 2;
     }
 
-    ray get_ray(Real s, Real t) const {
-        vec3 rd = lens_radius * random_in_unit_disk();
+    ray get_ray(Real s, Real t, rng& gen) const {
+        vec3 rd = lens_radius * random_in_unit_disk(gen);
         vec3 offset = u * rd.x + v * rd.y;
 
         return ray(origin + offset, normalize(lower_left_corner + s * horizontal +
                                         t * vertical - origin - offset));
     }
 
+    // without a lens all rays start at the same point, such cameras can
+    // generate packets
+    bool is_pinhole() const { return lens_radius == 0; }
+
+    // Fills packet with rays through count film positions (s[i], t[i]) of a
+    // pinhole camera, same rays as get_ray() would return.
+    void get_packet(const Real* s, const Real* t, int count, ray_packet* p) const {
+        for(int i=0; i<count; ++i) {
+            p->set_ray(i, ray(origin, normalize(lower_left_corner + s[i] * horizontal +
+                                                t[i] * vertical - origin)));
+        }
+        p->finalize(count);
+    }
+
   private:
     point3 origin;
     point3 lower_left_corner;
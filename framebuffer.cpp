@@ -0,0 +1,59 @@
+#include "framebuffer.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+static uint8_t to_ldr(Real v, Real scale) {
+#ifdef USE_GAMMA_CORRECTION
+    v = std::sqrt(scale * v);
+#else
+    v = scale * v;
+#endif
+    return (uint8_t)(255 * clamp(v, Real(0), Real(1)));
+}
+
+bool framebuffer::write_ppm(FILE* fh, Real scale) const {
+
+    char header[64];
+    const int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+
+    std::vector<uint8_t> data(header_len + (size_t)width * height * 3);
+    memcpy(data.data(), header, header_len);
+
+    uint8_t* dst = data.data() + header_len;
+    for(const color& c: pixels) {
+        *dst++ = to_ldr(c.x, scale);
+        *dst++ = to_ldr(c.y, scale);
+        *dst++ = to_ldr(c.z, scale);
+    }
+
+    return fwrite(data.data(), 1, data.size(), fh) == data.size();
+}
+
+bool framebuffer::write_pfm(FILE* fh, Real scale) const {
+
+    // negative scale in the header marks little endian data
+    const uint16_t endian_probe = 1;
+    const bool b_little_endian = *(const uint8_t*)&endian_probe == 1;
+
+    char header[64];
+    const int header_len = snprintf(header, sizeof(header), "PF\n%d %d\n%s\n",
+                                    width, height, b_little_endian ? "-1.0" : "1.0");
+
+    std::vector<uint8_t> data(header_len + (size_t)width * height * 3 * sizeof(float));
+    memcpy(data.data(), header, header_len);
+
+    // pfm stores rows bottom to top
+    float* dst = (float*)(data.data() + header_len);
+    for(int y = height - 1; y >= 0; --y) {
+        for(int x = 0; x < width; ++x) {
+            const color& c = at(x, y);
+            *dst++ = (float)(scale * c.x);
+            *dst++ = (float)(scale * c.y);
+            *dst++ = (float)(scale * c.z);
+        }
+    }
+
+    return fwrite(data.data(), 1, data.size(), fh) == data.size();
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+
+#include <vector>
+#include <cstdio>
+
+// Image accumulated by render threads, row 0 is the top row of the output
+// image (same order as pixels are written to file)
+struct framebuffer {
+    int width;
+    int height;
+    std::vector<color> pixels;
+
+    framebuffer(int w, int h):width(w), height(h), pixels((size_t)w * h, color(0, 0, 0)) {}
+
+    color& at(int x, int y) { return pixels[(size_t)y * width + x]; }
+    const color& at(int x, int y) const { return pixels[(size_t)y * width + x]; }
+
+    // Both write the whole image with a single fwrite, pixels are multiplied
+    // by scale (1 / samples per pixel) first.
+    // binary 8 bit P6, clamped to [0,1] and optionally gamma corrected
+    bool write_ppm(FILE* fh, Real scale) const;
+    // 32 bit float RGB, no clamping
+    bool write_pfm(FILE* fh, Real scale) const;
+};
@@ -1,12 +1,12 @@
 #pragma once
 
 #include "config.h"
-#include "material.h"
 #include "vec.h"
 
 struct hit_info {
     point3 p;
     vec3 normal;
     Real t;
-    material mat;
+    // index into scene material table, resolved once when shading
+    int32_t mat_id;
 };
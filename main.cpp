@@ -7,18 +7,35 @@
 #include "material.h"
 #include "ray.h"
 #include "hit.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include "simd_dispatch.h"
 
 #include "tinyxml2/tinyxml2.h"
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 
 const int g_samples_per_pixel = 1;
 const Real r1 = Real(1.0);
 const Real r0 = Real(0.0);
 const Real r05 = Real(0.5);
+const int g_tile_size = 32;
+const Real g_ray_t_min = 1e-3f;
+const Real g_ray_t_max = 1e+5f;
+
+// how far reflections of a primary ray are followed
+struct bounce_limits {
+    // number of reflections after the primary hit
+    int max_bounces;
+    // path stops once product of reflectances gets below this, 0 disables
+    Real min_weight;
+};
 
 
 #if 0
@@ -35,7 +52,7 @@ color ray_color(const ray& r, const scene& world, int depth_level) {
     if (world.intersect(r, t_min, t_max, rec)) {
         ray scattered;
         color attenuation;
-        if (rec.mat.scatter(r, rec, attenuation, scattered))
+        if (world.get_material(rec.mat_id).scatter(r, rec, attenuation, scattered))
             return attenuation * ray_color(scattered, world, depth_level-1);
         return color(0,0,0);
     }
@@ -47,9 +64,8 @@ color ray_color(const ray& r, const scene& world, int depth_level) {
 #endif
 
 bool ray_shadow(const ray& r, const scene& world, Real t_max) {
-    hit_info rec;
     Real t_min = 1e-3f;
-    return world.intersect(r, t_min, t_max, rec);
+    return world.occluded(r, t_min, t_max);
 }
 
 Real fresnel(Real n1, Real n2, vec3 normal, vec3 incident, Real refl_k)
@@ -75,126 +91,453 @@ Real fresnel(Real n1, Real n2, vec3 normal, vec3 incident, Real refl_k)
         return ret;
 }
 
-color ray_color(const ray& r, const scene& world, int depth_level) {
+color background_color(const ray& r, const scene& world) {
+    if (world.has_background()) {
+        return world.get_background();
+    } else {
+        vec3 unit_direction = r.direction();
+        auto t = 0.5 * (unit_direction.y + 1.0);
+        return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    }
+}
+
+// ray from the hit point towards light l, *t_max is distance to the light
+ray shadow_ray(const hit_info& rec, const light& l, Real* t_max) {
+    switch(l.get_type()) {
+        case light::Directional:
+            *t_max = Real(1e+5);
+            return ray(rec.p, -normalize(l.get_direction()));
+        case light::Point:
+        default:
+            {
+                vec3 light_dir = (rec.p - l.get_position());
+                Real dist2light = length(light_dir);
+                light_dir = light_dir / dist2light;
+                *t_max = dist2light;
+                return ray(rec.p, -light_dir);
+            }
+    }
+}
+
+// adds diffuse and specular terms of a light which is not shadowed
+void add_light(const ray& r, const hit_info& rec, const material& mat, const light& l,
+               color* diffuse, color* specular) {
+    switch(l.get_type()) {
+        case light::Directional:
+            {
+                const vec3& light_dir = normalize(l.get_direction());
+
+                const color& light_color = l.get_color();
+                Real ndotl = max(dot(rec.normal, -light_dir), r0);
+                *diffuse = *diffuse + ndotl * mat.kd * light_color;
+                
+                vec3 view_dir = normalize(r.origin() - rec.p);
+                vec3 reflected_dir = reflect(light_dir, rec.normal); 
+
+                Real spec = pow(max(dot(view_dir, reflected_dir), r0), mat.exponent);
+                *specular = *specular + mat.ks * spec * light_color;
+                break;
+            }
+        case light::Point:
+            {
+                vec3 light_dir = (rec.p - l.get_position());
+                Real dist2light = length(light_dir);
+                light_dir = light_dir / dist2light;
+                Real dist_sqr = 1;//dist2light*dist2light;
+
+                const color& light_color = l.get_color();
+                Real ndotl = max(dot(rec.normal, -light_dir), r0);
+                *diffuse = *diffuse + ndotl * light_color * mat.kd / dist_sqr;
+
+                vec3 view_dir = normalize(r.origin() - rec.p);
+                vec3 reflected_dir = reflect(light_dir, rec.normal); 
+
+                // Blinn-Phong
+                //vec3 h = Real(0.5)*(-light_dir + rec.normal);
+                //Real spec = pow(max(dot(h, rec.normal), r0), mat.exponent);
+                // Phong
+                Real spec = pow(max(dot(view_dir, reflected_dir), r0), mat.exponent);
+                *specular = *specular + mat.ks * spec * light_color / dist_sqr;  
+                break;
+            }
+    }
+}
+
+// returns false if the surface does not reflect r
+bool reflection_ray(const ray& r, const hit_info& rec, const material& mat, ray* r_refl, Real* k_refl) {
+    if(mat.reflectance <= r0)
+        return false;
+
+    vec3 reflected = reflect(normalize(r.direction()), rec.normal);
+    if(dot(reflected, rec.normal) <= 0)
+        return false;
+
+    *r_refl = ray(rec.p, reflected);
+    *k_refl = mat.reflectance;
+#ifdef USE_FRESNEL
+    vec3 incident = -normalize(r.origin() - rec.p);
+    *k_refl = fresnel(1.0, mat.refraction_iof, rec.normal, incident, *k_refl); 
+#endif
+    return true;
+}
+
+// lit colour of the surface hit by r without reflections
+color surface_color(const ray& r, const hit_info& rec, const material& mat, const scene& world) {
+    color ambient = mat.ka*world.get_ambient();
+    color diffuse = vec3(0,0,0);
+    color specular = vec3(0,0,0);
+    for(const auto& l: world.get_lights()) {
+        Real t_max;
+        ray sh_r = shadow_ray(rec, l, &t_max);
+        if(!ray_shadow(sh_r, world, t_max))
+            add_light(r, rec, mat, l, &diffuse, &specular);
+    }
+    return (ambient + diffuse) * mat.albedo + specular;
+}
+
+// Colour seen along r which hit rec. Reflection chain is followed in a loop,
+// every surface adds its colour weighted by product of reflectances of the
+// surfaces before it.
+color shade_hit(const ray& r, const hit_info& rec, const scene& world, const bounce_limits& limits) {
+
+    color result(0, 0, 0);
+    Real weight = 1;
+    ray cur_r = r;
+    hit_info cur_rec = rec;
+    for(int bounce = 0; ; ++bounce) {
+        const material& mat = world.get_material(cur_rec.mat_id);
+        Real k_refl = 0;
+        ray r_refl;
+        const bool b_reflected = reflection_ray(cur_r, cur_rec, mat, &r_refl, &k_refl);
+        result = result + weight * (1-k_refl) * surface_color(cur_r, cur_rec, mat, world);
+
+        if(!b_reflected || bounce >= limits.max_bounces)
+            break;
+        weight = weight * k_refl;
+        // nothing further along can noticeably change the pixel
+        if(weight < limits.min_weight)
+            break;
+
+        cur_r = r_refl;
+        if(!world.intersect(cur_r, g_ray_t_min, g_ray_t_max, cur_rec)) {
+            result = result + weight * background_color(cur_r, world);
+            break;
+        }
+    }
+    return result;
+}
+
+color ray_color(const ray& r, const scene& world, const bounce_limits& limits) {
 
     hit_info rec;
+    if (world.intersect(r, g_ray_t_min, g_ray_t_max, rec))
+        return shade_hit(r, rec, world, limits);
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth_level <= 0)
-        return color(0,0,0);
+    return background_color(r, world);
+}
 
-    Real t_min = 1e-3f;
-    Real t_max = 1e+5f;
-    if (world.intersect(r, t_min, t_max, rec)) {
-        color ambient = rec.mat.ka*world.get_ambient();
-        color diffuse = vec3(0,0,0);
-        color specular = vec3(0,0,0);
-        for(const auto& l: world.get_lights()) {
-            switch(l.get_type()) {
-                case light::Directional:
-                    {
-                        const vec3& light_dir = normalize(l.get_direction());
-
-                        ray sh_r(rec.p, -light_dir);
-                        bool b_in_shadow = ray_shadow(sh_r, world, Real(1e+5));
-                        if(b_in_shadow)
-                            break;
-
-                        const color& light_color = l.get_color();
-                        Real ndotl = max(dot(rec.normal, -light_dir), r0);
-                        diffuse = diffuse + ndotl * rec.mat.kd * light_color;
-                        
-                        vec3 view_dir = normalize(r.origin() - rec.p);
-                        vec3 reflected_dir = reflect(light_dir, rec.normal); 
-
-                        Real spec = pow(max(dot(view_dir, reflected_dir), r0), rec.mat.exponent);
-                        specular = specular + rec.mat.ks * spec * light_color;
-                        break;
-                    }
-                case light::Point:
-                    {
-                        vec3 light_dir = (rec.p - l.get_position());
-                        Real dist2light = length(light_dir);
-                        light_dir = light_dir / dist2light;
-                        Real dist_sqr = 1;//dist2light*dist2light;
-
-                        ray sh_r(rec.p, -light_dir);
-                        bool b_in_shadow = ray_shadow(sh_r, world, dist2light);
-                        if(b_in_shadow)
-                            break;
-
-                        const color& light_color = l.get_color();
-                        Real ndotl = max(dot(rec.normal, -light_dir), r0);
-                        diffuse = diffuse + ndotl * light_color * rec.mat.kd / dist_sqr;
-
-                        vec3 view_dir = normalize(r.origin() - rec.p);
-                        vec3 reflected_dir = reflect(light_dir, rec.normal); 
-
-                        // Blinn-Phong
-                        //vec3 h = Real(0.5)*(-light_dir + rec.normal);
-                        //Real spec = pow(max(dot(h, rec.normal), r0), rec.mat.exponent);
-                        // Phong
-                        Real spec = pow(max(dot(view_dir, reflected_dir), r0), rec.mat.exponent);
-                        specular = specular + rec.mat.ks * spec * light_color / dist_sqr;  
-                        break;
-                    }
+// Film position of sample s of pixel (i, j). Every sample gets its own
+// generator so the result does not depend on how tiles are scheduled
+// between threads, it is returned for the rest of the sample.
+rng film_position(int i, int j, int s, Real oo_w, Real oo_h, Real* u, Real* v) {
+    rng gen = rng::for_pixel(i, j, s);
+    *u = Real(i) * oo_w;
+    *v = Real(j) * oo_h;
+    if (g_samples_per_pixel > 1) {
+        *u += random_Real(gen) * oo_w;
+        *v += random_Real(gen) * oo_h;
+    }
+    return gen;
+}
+
+void render_tile(int tile_idx, const camera& cam, const scene& world, const bounce_limits& limits,
+                 framebuffer* fb) {
+
+    const int tiles_x = (fb->width + g_tile_size - 1) / g_tile_size;
+    const int x0 = (tile_idx % tiles_x) * g_tile_size;
+    const int y0 = (tile_idx / tiles_x) * g_tile_size;
+    const int x1 = min(x0 + g_tile_size, fb->width);
+    const int y1 = min(y0 + g_tile_size, fb->height);
+
+    Real oo_w = Real(1.0) / Real(fb->width - 1);
+    Real oo_h = Real(1.0) / Real(fb->height - 1);
+    for (int y = y0; y < y1; ++y) {
+        // framebuffer rows go top to bottom, v goes bottom to top
+        const int j = fb->height - 1 - y;
+        for (int i = x0; i < x1; ++i) {
+
+            color pixel(0, 0, 0);
+            for (int s = 0; s < g_samples_per_pixel; ++s) {
+                Real u, v;
+                rng gen = film_position(i, j, s, oo_w, oo_h, &u, &v);
+
+                ray r = cam.get_ray(u, v, gen);
+                pixel = pixel + ray_color(r, world, limits);
             }
+            fb->at(i, y) = pixel;
         }
-        
-        color refl = color(1,1,1);
-        Real k_refl = 0;
-        if(rec.mat.reflectance > r0) {
-            vec3 reflected = reflect(normalize(r.direction()), rec.normal);
-            if(dot(reflected, rec.normal) > 0) {
-                ray r_refl(rec.p, reflected);
-                refl = ray_color(r_refl, world, depth_level-1);
-                k_refl = rec.mat.reflectance;
-#ifdef USE_FRESNEL
-                vec3 incident = -normalize(r.origin() - rec.p);
-                k_refl = fresnel(1.0, rec.mat.refraction_iof, rec.normal, incident, k_refl); 
-#endif
+    }
+}
+
+// Same as render_tile() but primary rays of every kPacketDim x kPacketDim
+// block of pixels are traced together as a packet, secondary rays are still
+// traced one by one. Needs pinhole camera.
+void render_tile_packets(int tile_idx, const camera& cam, const scene& world, const bounce_limits& limits,
+                         framebuffer* fb) {
+
+    const int tiles_x = (fb->width + g_tile_size - 1) / g_tile_size;
+    const int x0 = (tile_idx % tiles_x) * g_tile_size;
+    const int y0 = (tile_idx / tiles_x) * g_tile_size;
+    const int x1 = min(x0 + g_tile_size, fb->width);
+    const int y1 = min(y0 + g_tile_size, fb->height);
+
+    Real oo_w = Real(1.0) / Real(fb->width - 1);
+    Real oo_h = Real(1.0) / Real(fb->height - 1);
+
+    ray_packet packet;
+    hit_info hits[kPacketSize];
+    bool b_hits[kPacketSize];
+    Real us[kPacketSize], vs[kPacketSize];
+    for (int by = y0; by < y1; by += kPacketDim) {
+        for (int bx = x0; bx < x1; bx += kPacketDim) {
+            const int bw = min(kPacketDim, x1 - bx);
+            const int bh = min(kPacketDim, y1 - by);
+            const int count = bw * bh;
+
+            color pixels[kPacketSize];
+            for (int k = 0; k < count; ++k) {
+                pixels[k] = color(0, 0, 0);
+            }
+
+            for (int s = 0; s < g_samples_per_pixel; ++s) {
+                for (int k = 0; k < count; ++k) {
+                    const int i = bx + k % bw;
+                    const int j = fb->height - 1 - (by + k / bw);
+                    film_position(i, j, s, oo_w, oo_h, &us[k], &vs[k]);
+                }
+
+                cam.get_packet(us, vs, count, &packet);
+                world.intersect_packet(packet, g_ray_t_min, g_ray_t_max, hits, b_hits);
+
+                for (int k = 0; k < count; ++k) {
+                    const ray r = packet.get_ray(k);
+                    pixels[k] = pixels[k] + (b_hits[k] ? shade_hit(r, hits[k], world, limits)
+                                                       : background_color(r, world));
+                }
+            }
+
+            for (int k = 0; k < count; ++k) {
+                fb->at(bx + k % bw, by + k / bw) = pixels[k];
             }
         }
+    }
+}
 
-        return ((ambient + diffuse) * rec.mat.albedo + specular) * (1-k_refl) + refl * k_refl;
+// ray waiting in a wavefront queue with the pixel it contributes to
+struct wavefront_ray {
+    ray r;
+    // index of the pixel within the tile
+    int32_t pixel;
+    // product of reflectances along the path
+    Real weight;
+    // reflections before this ray
+    int bounce;
+};
+
+// Breadth first version of render_tile(). All rays of one bounce in the tile
+// are traced together: closest hits of all of them first, then shadow rays
+// of all hits light by light, and only then the hits are shaded and spawn
+// reflection rays of the next bounce. Instead of blending reflections on the
+// way back from recursion, every surface adds its colour multiplied by the
+// reflectances along the path.
+void render_tile_wavefront(int tile_idx, const camera& cam, const scene& world, const bounce_limits& limits,
+                           framebuffer* fb) {
+
+    const int tiles_x = (fb->width + g_tile_size - 1) / g_tile_size;
+    const int x0 = (tile_idx % tiles_x) * g_tile_size;
+    const int y0 = (tile_idx / tiles_x) * g_tile_size;
+    const int x1 = min(x0 + g_tile_size, fb->width);
+    const int y1 = min(y0 + g_tile_size, fb->height);
+    const int tile_w = x1 - x0;
+
+    Real oo_w = Real(1.0) / Real(fb->width - 1);
+    Real oo_h = Real(1.0) / Real(fb->height - 1);
+
+    std::vector<color> pixels(tile_w * (y1 - y0), color(0, 0, 0));
+    std::vector<wavefront_ray> rays;
+    rays.reserve(pixels.size() * g_samples_per_pixel);
+    for (int y = y0; y < y1; ++y) {
+        const int j = fb->height - 1 - y;
+        for (int i = x0; i < x1; ++i) {
+            for (int s = 0; s < g_samples_per_pixel; ++s) {
+                Real u, v;
+                rng gen = film_position(i, j, s, oo_w, oo_h, &u, &v);
+                rays.push_back({ cam.get_ray(u, v, gen), (y - y0) * tile_w + (i - x0), Real(1), 0 });
+            }
+        }
     }
 
-    if (world.has_background()) {
-        return world.get_background();
-    } else {
-        vec3 unit_direction = r.direction();
-        auto t = 0.5 * (unit_direction.y + 1.0);
-        return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+    const std::vector<light>& lights = world.get_lights();
+    const aabb bounds = world.get_bounds();
+    std::vector<hit_info> hits;
+    std::vector<uint8_t> b_hits;
+    // per light, per ray
+    std::vector<uint8_t> b_shadowed;
+    std::vector<wavefront_ray> next_rays;
+    std::vector<std::pair<uint64_t, int32_t>> keys;
+    while (!rays.empty()) {
+        const size_t n = rays.size();
+
+        hits.resize(n);
+        b_hits.resize(n);
+        for (size_t k = 0; k < n; ++k) {
+            b_hits[k] = world.intersect(rays[k].r, g_ray_t_min, g_ray_t_max, hits[k]);
+        }
+
+        b_shadowed.resize(lights.size() * n);
+        for (size_t li = 0; li < lights.size(); ++li) {
+            for (size_t k = 0; k < n; ++k) {
+                if (!b_hits[k])
+                    continue;
+                Real t_max;
+                ray sh_r = shadow_ray(hits[k], lights[li], &t_max);
+                b_shadowed[li * n + k] = ray_shadow(sh_r, world, t_max);
+            }
+        }
+
+        next_rays.clear();
+        for (size_t k = 0; k < n; ++k) {
+            const wavefront_ray& wr = rays[k];
+            color& pixel = pixels[wr.pixel];
+            if (!b_hits[k]) {
+                pixel = pixel + wr.weight * background_color(wr.r, world);
+                continue;
+            }
+
+            const hit_info& rec = hits[k];
+            const material& mat = world.get_material(rec.mat_id);
+            color ambient = mat.ka*world.get_ambient();
+            color diffuse = vec3(0,0,0);
+            color specular = vec3(0,0,0);
+            for (size_t li = 0; li < lights.size(); ++li) {
+                if (!b_shadowed[li * n + k])
+                    add_light(wr.r, rec, mat, lights[li], &diffuse, &specular);
+            }
+
+            Real k_refl = 0;
+            ray r_refl;
+            const bool b_reflected = reflection_ray(wr.r, rec, mat, &r_refl, &k_refl);
+            pixel = pixel + wr.weight * (1-k_refl) * ((ambient + diffuse) * mat.albedo + specular);
+
+            const Real weight = wr.weight * k_refl;
+            if (b_reflected && wr.bounce < limits.max_bounces && weight >= limits.min_weight)
+                next_rays.push_back({ r_refl, wr.pixel, weight, wr.bounce + 1 });
+        }
+
+        // reflection rays are sorted by direction octant and then by origin
+        // so that neighbours in the queue walk similar parts of the scene
+        keys.resize(next_rays.size());
+        for (size_t k = 0; k < next_rays.size(); ++k) {
+            const ray& r = next_rays[k].r;
+            const uint64_t octant = (r.dir.x < 0 ? 4 : 0) | (r.dir.y < 0 ? 2 : 0) | (r.dir.z < 0 ? 1 : 0);
+            keys[k] = { (octant << 30) | morton_code(r.orig, bounds), (int32_t)k };
+        }
+        std::sort(keys.begin(), keys.end());
+        rays.resize(next_rays.size());
+        for (size_t k = 0; k < keys.size(); ++k) {
+            rays[k] = next_rays[keys[k].second];
+        }
     }
-}
 
-void write_color(FILE* fh, color pixel) {
+    for (int y = y0; y < y1; ++y) {
+        for (int i = x0; i < x1; ++i) {
+            fb->at(i, y) = pixels[(y - y0) * tile_w + (i - x0)];
+        }
+    }
+}
 
-    constexpr Real scale = Real(1.0) / g_samples_per_pixel;
-#ifdef USE_GAMMA_CORRECTION
-    pixel.x = std::sqrt(scale * pixel.x);
-    pixel.y = std::sqrt(scale * pixel.y);
-    pixel.z = std::sqrt(scale * pixel.z);
-#else
-    pixel = scale * pixel;
-#endif
+// position of the dot starting the extension, npos if there is none, dots
+// in directory names do not count
+size_t find_extension(const std::string& filename) {
+    const size_t slash_pos = filename.find_last_of('/');
+    const size_t dot_pos = filename.find_last_of('.');
+    if(slash_pos != std::string::npos && dot_pos < slash_pos)
+        return std::string::npos;
+    return dot_pos;
+}
 
-    int ir = (int)(255 * clamp(pixel.x, Real(0), Real(1)));
-    int ig = (int)(255 * clamp(pixel.y, Real(0), Real(1)));
-    int ib = (int)(255 * clamp(pixel.z, Real(0), Real(1)));
+// name of an animation frame, frame number goes before the extension
+std::string numbered_filename(const std::string& filename, int frame) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", frame);
+    const size_t dot_pos = find_extension(filename);
+    std::string name = filename.substr(0, dot_pos);
+    name.append(suffix);
+    if(dot_pos != std::string::npos)
+        name.append(filename, dot_pos, std::string::npos);
+    return name;
+}
 
-    //fprintf(fh, "%d %d %d\n", ir, ig, ib);
-    fprintf(fh, "%d %d %d\n", ir, ig, ib);
+void print_usage(const char* exe) {
+    printf("usage:\n\t %s [options] <scene xml file>\n"
+           "options:\n"
+           "\t--threads N            number of render threads\n"
+           "\t--no-mesh-cache        always parse obj files, do not read or write mesh cache\n"
+           "\t--mesh-cache-dir DIR   store mesh cache files in DIR instead of next to obj files\n"
+           "\t--no-packets           trace primary rays one by one instead of in packets\n"
+           "\t--wavefront            trace rays of a tile bounce by bounce instead of depth first\n"
+           "\t--min-weight W         stop following reflections which contribute less than W\n"
+           "\t--bvh-builder B        build hierarchies with sah or lbvh, overrides the scene setting\n"
+           "\t--simd ISA             use scalar, sse42 or avx2 kernels instead of the best supported ones\n", exe);
 }
 
 int main(int argc, char** argv) {
 
     std::string scene_filename;
     std::string output_filename = "result.ppm";
-    if(argc > 1) {
-        scene_filename = argv[1];
-    } else {
-        printf("No filename given, usage:\n\t %s <scene xml file>\n", argv[0]);
+    bool b_write_pfm = false;
+    int num_threads = thread_pool::default_num_threads();
+    bool b_use_packets = true;
+    bool b_wavefront = false;
+    bounce_limits limits = { 8, Real(0) };
+    scene::load_options load_opts;
+    const simd_isa best_isa = detect_simd_isa();
+    simd_isa isa = best_isa;
+    for(int i=1; i<argc; ++i) {
+        if(!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "--no-mesh-cache")) {
+            load_opts.b_use_mesh_cache = false;
+        } else if(!strcmp(argv[i], "--mesh-cache-dir") && i + 1 < argc) {
+            load_opts.mesh_cache_dir = argv[++i];
+        } else if(!strcmp(argv[i], "--no-packets")) {
+            b_use_packets = false;
+        } else if(!strcmp(argv[i], "--wavefront")) {
+            b_wavefront = true;
+        } else if(!strcmp(argv[i], "--min-weight") && i + 1 < argc) {
+            limits.min_weight = (Real)atof(argv[++i]);
+        } else if(!strcmp(argv[i], "--bvh-builder") && i + 1 < argc) {
+            load_opts.bvh_builder = argv[++i];
+        } else if(!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            if(!parse_simd_isa(argv[++i], &isa)) {
+                printf("Unknown instruction set: %s\n", argv[i]);
+                return -1;
+            }
+            if(isa > best_isa) {
+                printf("%s kernels are not supported by this CPU, using %s\n", argv[i], simd_isa_name(best_isa));
+                isa = best_isa;
+            }
+        } else if(argv[i][0] == '-') {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return -1;
+        } else {
+            scene_filename = argv[i];
+        }
+    }
+    if(scene_filename.empty()) {
+        printf("No filename given, ");
+        print_usage(argv[0]);
         return -1;
     }
 
@@ -213,26 +556,37 @@ int main(int argc, char** argv) {
 
     camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, focus_dist);
 
+    select_simd_isa(isa);
+
+    thread_pool pool(num_threads);
+
+    load_opts.pool = &pool;
+
     scene my_scene;
     if (scene_filename.empty()) {
         my_scene.add_sphere(point3(0, 0, -1), r05,
                             material(color(0.7, 0.3, 0.3)));
         my_scene.add_sphere(point3(0, -100.5, -1), Real(100),
                             material(color(0.8, 0.8, 0)));
+        my_scene.build_accel();
     } else {
-        if(!my_scene.load(scene_filename.c_str())) {
+        if(!my_scene.load(scene_filename.c_str(), load_opts)) {
             return -1;
         }
 
         const scene::camera_params& cp = my_scene.get_camera_params();
         output_filename = my_scene.get_output_filename();
-        // change extension to ppm
-        size_t dot_pos = output_filename.find_last_of('.');
+        // keep pfm for hdr output, everything else is changed to ppm
+        size_t dot_pos = find_extension(output_filename);
         if(dot_pos!=std::string::npos && dot_pos < output_filename.size()-1) {
-            output_filename = output_filename.substr(0, dot_pos + 1);
-            output_filename.append("ppm");
+            b_write_pfm = output_filename.compare(dot_pos + 1, std::string::npos, "pfm") == 0;
+            if(!b_write_pfm) {
+                output_filename = output_filename.substr(0, dot_pos + 1);
+                output_filename.append("ppm");
+            }
         }
 
+        limits.max_bounces = cp.max_bounces;
         image_width = cp.res_x;
         image_height = cp.res_y;
         aspect_ratio = Real(image_width) / Real(image_height);
@@ -240,28 +594,52 @@ int main(int argc, char** argv) {
         cam = camera(cp.pos, cp.lookat, cp.up, vfov, aspect_ratio, aperture, focus_dist);
     }
 
-    FILE* f = fopen(output_filename.c_str(), "w");
-    if(!f) {
-        printf("Cannot open result.ppm file for writing\n");
-        return -1;
+    const int num_frames = my_scene.get_num_frames();
+    printf("Rendering %dx%d using %d threads, %s kernels (best supported: %s)\n", image_width, image_height,
+           pool.get_num_threads(), simd_isa_name(get_simd_isa()), simd_isa_name(best_isa));
+    if(num_frames > 1) {
+        printf("Animation of %d frames\n", num_frames);
     }
-    fprintf(f, "P3\n%d %d\n255\n", image_width, image_height);
-
-    Real oo_w = Real(1.0) / Real(image_width - 1);
-    Real oo_h = Real(1.0) / Real(image_height - 1);
-    for (int j = image_height - 1; j >= 0; --j) {
-        for (int i = 0; i < image_width; ++i) {
-
-            Real u = Real(i) * oo_w;
-            Real v = Real(j) * oo_h;
-            
-            ray r = cam.get_ray(u, v);
-            color pixel;
-            pixel = ray_color(r, my_scene, 8);
-            write_color(f, pixel);
+
+    framebuffer fb(image_width, image_height);
+    const int tiles_x = (image_width + g_tile_size - 1) / g_tile_size;
+    const int tiles_y = (image_height + g_tile_size - 1) / g_tile_size;
+    b_use_packets = b_use_packets && cam.is_pinhole();
+    for(int frame = 0; frame < num_frames; ++frame) {
+        const std::string frame_filename = num_frames > 1 ? numbered_filename(output_filename, frame) : output_filename;
+        FILE* f = fopen(frame_filename.c_str(), "wb");
+        if(!f) {
+            printf("Cannot open %s file for writing\n", frame_filename.c_str());
+            return -1;
+        }
+
+        if(num_frames > 1) {
+            scene::frame_stats stats;
+            auto t0 = std::chrono::steady_clock::now();
+            my_scene.set_frame(frame, &stats);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            printf("Frame %d: refitted %d meshes, rebuilt %d meshes%s in %.3f s\n", frame,
+                   stats.num_refit_meshes, stats.num_rebuilt_meshes,
+                   stats.b_top_level_rebuilt ? " and top level" : "", seconds);
+        }
+
+        pool.parallel_for(tiles_x * tiles_y, [&](int tile_idx, int /*thread_idx*/) {
+            if(b_wavefront)
+                render_tile_wavefront(tile_idx, cam, my_scene, limits, &fb);
+            else if(b_use_packets)
+                render_tile_packets(tile_idx, cam, my_scene, limits, &fb);
+            else
+                render_tile(tile_idx, cam, my_scene, limits, &fb);
+        });
+
+        const Real scale = Real(1.0) / g_samples_per_pixel;
+        bool b_written = b_write_pfm ? fb.write_pfm(f, scale) : fb.write_ppm(f, scale);
+        fclose(f);
+        if(!b_written) {
+            printf("Failed to write %s\n", frame_filename.c_str());
+            return -1;
         }
     }
-    fclose(f);
 
     return 0;
 }
@@ -0,0 +1,47 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool mapped_file::open(const char* filename, bool b_sequential) {
+
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    // mmap does not accept empty ranges, empty file is just no data
+    len = (size_t)st.st_size;
+    if(len) {
+        ptr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED) {
+            ptr = nullptr;
+            len = 0;
+            ::close(fd);
+            return false;
+        }
+        if(b_sequential)
+            madvise(ptr, len, MADV_SEQUENTIAL);
+    }
+
+    // mapping stays valid after the descriptor is closed
+    ::close(fd);
+    return true;
+}
+
+void mapped_file::close() {
+    if(ptr) {
+        munmap(ptr, len);
+    }
+    ptr = nullptr;
+    len = 0;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Read only memory mapping of a whole file
+class mapped_file {
+  public:
+    mapped_file() = default;
+    ~mapped_file() { close(); }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    // mappings read once from start to end can have the kernel read ahead
+    // and drop pages behind, the others are accessed in any order
+    bool open(const char* filename, bool b_sequential = true);
+    void close();
+
+    const char* data() const { return (const char*)ptr; }
+    size_t size() const { return len; }
+
+  private:
+    void* ptr = nullptr;
+    size_t len = 0;
+};
+
+// Elements held in a vector of their own or referenced in a mapped file,
+// which then stays mapped as long as any array refers to it. Elements are
+// read only, take() gives a vector to change and assigning it back stores
+// the result.
+template <typename T>
+class mapped_array {
+  public:
+    mapped_array() = default;
+    mapped_array(std::vector<T>&& v) { *this = std::move(v); }
+    mapped_array(const mapped_array& other) { *this = other; }
+    mapped_array(mapped_array&& other) { *this = std::move(other); }
+
+    mapped_array& operator=(std::vector<T>&& v) {
+        file.reset();
+        owned = std::move(v);
+        elems = owned.data();
+        count = owned.size();
+        return *this;
+    }
+
+    mapped_array& operator=(const mapped_array& other) {
+        if(this == &other)
+            return *this;
+        if(other.file)
+            map(other.file, other.elems, other.count);
+        else
+            *this = std::vector<T>(other.owned);
+        return *this;
+    }
+
+    mapped_array& operator=(mapped_array&& other) {
+        if(this == &other)
+            return *this;
+        owned = std::move(other.owned);
+        file = std::move(other.file);
+        elems = file ? other.elems : owned.data();
+        count = other.count;
+        other.clear();
+        return *this;
+    }
+
+    // count elements from first on, which has to point into file
+    void map(std::shared_ptr<const mapped_file> f, const T* first, size_t n) {
+        owned = std::vector<T>();
+        file = std::move(f);
+        elems = first;
+        count = n;
+    }
+
+    // elements as a vector to change, copied out of the file when mapped,
+    // the array is left empty
+    std::vector<T> take() {
+        std::vector<T> v = file ? std::vector<T>(elems, elems + count) : std::move(owned);
+        clear();
+        return v;
+    }
+
+    void clear() {
+        owned = std::vector<T>();
+        file.reset();
+        elems = nullptr;
+        count = 0;
+    }
+
+    bool is_mapped() const { return file != nullptr; }
+    const T* data() const { return elems; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return elems[i]; }
+    const T* begin() const { return elems; }
+    const T* end() const { return elems + count; }
+
+  private:
+    std::vector<T> owned;
+    std::shared_ptr<const mapped_file> file;
+    // owned.data() unless mapped
+    const T* elems = nullptr;
+    size_t count = 0;
+};
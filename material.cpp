@@ -6,7 +6,7 @@
 
 #if METAL
 bool material::scatter(const ray &r_in, const hit_info &rec, color &attenuation,
-                       ray &scattered) const {
+                       ray &scattered, rng &gen) const {
     vec3 reflected = reflect(normalize(r_in.direction()), rec.normal);
     scattered = ray(rec.p, reflected);
     attenuation = albedo;
@@ -14,8 +14,8 @@ bool material::scatter(const ray &r_in, const hit_info &rec, color &attenuation,
 }
 #elif LAMBERTIAN
 bool material::scatter(const ray &r_in, const hit_info &rec, color &attenuation,
-                       ray &scattered) const {
-    auto scatter_direction = rec.normal + random_unit_vector();
+                       ray &scattered, rng &gen) const {
+    auto scatter_direction = rec.normal + random_unit_vector(gen);
 
     // Catch degenerate scatter direction
     if (near_zero(scatter_direction))
@@ -32,8 +32,8 @@ class lambertian : public material {
     lambertian(const color &a) : material(a) {}
 
     virtual bool scatter(const ray &r_in, const hit_info &rec,
-                         color &attenuation, ray &scattered) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+                         color &attenuation, ray &scattered, rng &gen) const override {
+        auto scatter_direction = rec.normal + random_unit_vector(gen);
 
         // Catch degenerate scatter direction
         if (near_zero(scatter_direction))
@@ -40,6 +40,6 @@ struct material {
           refraction_iof(1.0), albedo(c) {}
 
     //metal
-    virtual bool scatter(const ray& r_in, const struct hit_info& rec, color& attenuation, ray& scattered) const;
+    virtual bool scatter(const ray& r_in, const struct hit_info& rec, color& attenuation, ray& scattered, rng& gen) const;
 };
 
@@ -3,96 +3,296 @@
 #include "vec.h"
 #include "obj_loader.h"
 
-mesh::~mesh() {
-    delete obj_model;
+mesh::mesh(std::shared_ptr<const struct ObjFile> obj):obj_model(std::move(obj)) {
+
+    build_triangles(obj_model->p.data(), obj_model->n.data());
 }
 
-mesh::mesh(const struct ObjFile* obj, const material& m):obj_model(obj), mat(m) {
+mesh::mesh(std::shared_ptr<const struct ObjFile> obj, bvh&& prebuilt)
+    :obj_model(std::move(obj)), accel(std::move(prebuilt)), b_accel_built(true) {
+
+    build_triangles(obj_model->p.data(), obj_model->n.data());
+    build_blocks();
+}
+
+static void triangle_bounds(const std::vector<mesh_triangle>& tris, std::vector<aabb>* bounds) {
+
+    bounds->assign(tris.size(), aabb());
+    for(size_t k=0; k<tris.size(); ++k) {
+        const mesh_triangle& tri = tris[k];
+        (*bounds)[k].grow(tri.v0);
+        (*bounds)[k].grow(tri.v0 + tri.e1);
+        (*bounds)[k].grow(tri.v0 + tri.e2);
+    }
 }
 
-bool ray_tri_intersect( 
-    const vec3 &orig, const vec3 &dir, 
-    const vec3 &v0, const vec3 &v1, const vec3 &v2, const vec3* normal,
-    vec3& p, Real &t) 
-{ 
-    vec3 n;
-    if(!normal) {
-        vec3 v0v1 = v1 - v0; 
-        vec3 v0v2 = v2 - v0; 
-        // no need to normalize (we will divide on dot so length will cancel out)
-        n = cross(v0v1, v0v2);
-    } else {
-        n = *normal;
+void mesh::build_accels(mesh* const* meshes, int count, thread_pool* pool,
+                        bvh_build_method method) {
+
+    std::vector<mesh*> pending;
+    for(int i=0; i<count; ++i) {
+        if(!meshes[i]->b_accel_built)
+            pending.push_back(meshes[i]);
     }
- 
-    // check if ray and plane are parallel ?
-    const Real n_dot_ray = dot(n, dir); 
-    if (fabs(n_dot_ray) < kEps)
+
+    std::vector<std::vector<aabb>> tri_bounds(pending.size());
+    std::vector<bvh_build_job> jobs(pending.size());
+    for(size_t i=0; i<pending.size(); ++i) {
+        triangle_bounds(pending[i]->tris, &tri_bounds[i]);
+        jobs[i] = { &pending[i]->accel, tri_bounds[i].data(), (int)tri_bounds[i].size(), kTriBlockWidth, method };
+    }
+
+    build_bvhs(jobs.data(), (int)jobs.size(), pool);
+
+    for(mesh* m: pending) {
+        m->build_blocks();
+        m->b_accel_built = true;
+    }
+}
+
+bool mesh::update_vertices(const std::vector<vec3>& p, const std::vector<vec3>* n) {
+
+    build_triangles(p.data(), n ? n->data() : nullptr);
+    if(!b_accel_built)
         return false;
- 
-    // compute distance to the plane
-    const Real dist = dot(n, v0); 
- 
-    // compute t 
-    t = (-dot(n,orig) + dist) / n_dot_ray; 
-    if (t < 0) return false; // the triangle is behind 
- 
-    // ray dir vs. plane intersection point
-    p = orig + t * dir; 
- 
-    // inside-outside tests
-    vec3 c;
- 
-    // edge 0
-    vec3 edge0 = v1 - v0; 
-    vec3 vp0 = p - v0; 
-    c = cross(edge0, vp0); 
-    if (dot(n, c) < 0) return false; // P is on the right side 
- 
-    // edge 1
-    vec3 edge1 = v2 - v1; 
-    vec3 vp1 = p - v1; 
-    c = cross(edge1, vp1); 
-    if (dot(n, c) < 0)  return false; // P is on the right side 
- 
-    // edge 2
-    vec3 edge2 = v0 - v2; 
-    vec3 vp2 = p - v2; 
-    c = cross(edge2, vp2); 
-    if (dot(n, c) < 0) return false; // P is on the right side; 
- 
-    return true; // this ray hits the triangle 
-} 
 
-bool mesh::hit(const ray &r, Real t_min, Real t_max, hit_info &rec) const {
+    std::vector<aabb> bounds;
+    triangle_bounds(tris, &bounds);
+    accel.refit(bounds.data());
+    if(accel.get_refit_cost_ratio() > bvh::kMaxRefitCostRatio) {
+        accel.clear();
+        b_accel_built = false;
+        return false;
+    }
+    build_blocks();
+    return true;
+}
 
-    int num_tris = (int)obj_model->faces.size() / 3;
-    rec.t = t_max;
-    bool b_intersected = false;
+void mesh::build_triangles(const vec3* p, const vec3* normals) {
+
+    const int num_tris = (int)obj_model->faces.size() / 3;
+    tris.resize(num_tris);
     for(int i=0;i<num_tris;++i) {
-        vec3 v0 = obj_model->p[obj_model->faces[3*i + 0].p - 1];
-        vec3 v1 = obj_model->p[obj_model->faces[3*i + 1].p - 1];
-        vec3 v2 = obj_model->p[obj_model->faces[3*i + 2].p - 1];
-        // get normal from first point normal(assume flat normals)
-        vec3 n = obj_model->n[obj_model->faces[3*i + 0].n - 1];
-
-        Real t;
-        vec3 p;
-        // flip normal because we want to check for interior
-        if(ray_tri_intersect(r.origin(), r.direction(), v0, v1, v2, &n, p, t) && t > t_min && t < t_max) {
-            if(t < rec.t) {
-                rec.t = t;
-                rec.p = p;
-                rec.normal = n;
-                b_intersected = true;
+        const ObjVertexId* f = &obj_model->faces[3*i];
+        const vec3 v0 = p[f[0].p - 1];
+        const vec3 v1 = p[f[1].p - 1];
+        const vec3 v2 = p[f[2].p - 1];
+
+        mesh_triangle& tri = tris[i];
+        tri.v0 = v0;
+        tri.e1 = v1 - v0;
+        tri.e2 = v2 - v0;
+        if(normals && f[0].n > 0) {
+            tri.n = normals[f[0].n - 1];
+        } else {
+            vec3 n = cross(tri.e1, tri.e2);
+            tri.n = lengthSqr(n) > 0 ? normalize(n) : vec3(0, 0, 1);
+        }
+    }
+}
+
+void mesh::build_blocks() {
+
+    const mapped_array<bvh_node>& nodes = accel.get_nodes();
+    const mapped_array<int32_t>& prims = accel.get_prim_indices();
+
+    blocks.clear();
+    leaf_blocks.assign(nodes.size(), -1);
+    for(size_t i=0; i<nodes.size(); ++i) {
+        const bvh_node& n = nodes[i];
+        if(!n.is_leaf())
+            continue;
+
+        leaf_blocks[i] = (int32_t)blocks.size();
+        for(int first = 0; first < n.count; first += kTriBlockWidth) {
+            blocks.emplace_back();
+            tri_block& b = blocks.back();
+            for(int lane = 0; lane < kTriBlockWidth; ++lane) {
+                const int k = first + lane;
+                // padding lanes have zero edges so determinant is 0 and they never hit
+                const int tri_id = k < n.count ? prims[n.first + k] : -1;
+                const mesh_triangle& tri = tri_id >= 0 ? tris[tri_id] : mesh_triangle{vec3(0,0,0), vec3(0,0,0), vec3(0,0,0), vec3(0,0,0)};
+                b.v0x[lane] = tri.v0.x; b.v0y[lane] = tri.v0.y; b.v0z[lane] = tri.v0.z;
+                b.e1x[lane] = tri.e1.x; b.e1y[lane] = tri.e1.y; b.e1z[lane] = tri.e1.z;
+                b.e2x[lane] = tri.e2.x; b.e2y[lane] = tri.e2.y; b.e2z[lane] = tri.e2.z;
+                b.tri_id[lane] = tri_id;
             }
         }
     }
+}
+
+bool mesh::intersect(const ray &r, Real t_min, Real t_max, Real* t, int32_t* tri) const {
+
+    const vec3 orig = r.origin();
+    const vec3 dir = r.direction();
+    const mapped_array<bvh_node>& nodes = accel.get_nodes();
+    int best_tri = -1;
+    Real best_t = t_max;
+    accel.intersect_leaves(r, t_min, t_max, [&](int32_t node_idx, Real& t_closest) {
+        const int32_t first = leaf_blocks[node_idx];
+        const int32_t last = first + (nodes[node_idx].count + kTriBlockWidth - 1) / kTriBlockWidth;
+        bool b_hit = false;
+        for(int32_t i = first; i < last; ++i) {
+            const int lane = tri_block_intersect(blocks[i], orig, dir, t_min, &t_closest);
+            if(lane >= 0) {
+                best_t = t_closest;
+                best_tri = blocks[i].tri_id[lane];
+                b_hit = true;
+            }
+        }
+        return b_hit;
+    });
+
+    if(best_tri < 0)
+        return false;
+
+    *t = best_t;
+    *tri = best_tri;
+    return true;
+}
 
-    if(b_intersected) {
-        rec.mat = mat;
+bool mesh::hit(const ray &r, Real t_min, Real t_max, hit_info &rec) const {
+
+    Real t;
+    int32_t tri;
+    if(!intersect(r, t_min, t_max, &t, &tri))
+        return false;
+
+    finalize_hit(r, t, tri, rec);
+    return true;
+}
+
+bool mesh::occluded(const ray &r, Real t_min, Real t_max) const {
+
+    const vec3 orig = r.origin();
+    const vec3 dir = r.direction();
+    const mapped_array<bvh_node>& nodes = accel.get_nodes();
+    return accel.occluded_leaves(r, t_min, t_max, [&](int32_t node_idx) {
+        const int32_t first = leaf_blocks[node_idx];
+        const int32_t last = first + (nodes[node_idx].count + kTriBlockWidth - 1) / kTriBlockWidth;
+        for(int32_t i = first; i < last; ++i) {
+            Real t_closest = t_max;
+            if(tri_block_intersect(blocks[i], orig, dir, t_min, &t_closest) >= 0)
+                return true;
+        }
+        return false;
+    });
+}
+
+// Tests rays [first, num_rays) of a packet against one lane of a block,
+// 4 rays at a time. Same operations as ray_tri_intersect().
+static void packet_tri_intersect(ray_packet& p, int first, int end, const tri_block& b, int lane,
+                                 Real t_min, int32_t obj_id) {
+#if defined(__SSE2__)
+    const __m128 e1x = _mm_set1_ps(b.e1x[lane]), e1y = _mm_set1_ps(b.e1y[lane]), e1z = _mm_set1_ps(b.e1z[lane]);
+    const __m128 e2x = _mm_set1_ps(b.e2x[lane]), e2y = _mm_set1_ps(b.e2y[lane]), e2z = _mm_set1_ps(b.e2z[lane]);
+    const __m128 v0x = _mm_set1_ps(b.v0x[lane]), v0y = _mm_set1_ps(b.v0y[lane]), v0z = _mm_set1_ps(b.v0z[lane]);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tmin = _mm_set1_ps(t_min);
+
+    for(int k = first & ~3; k < end; k += 4) {
+        const __m128 dx = _mm_load_ps(p.dx + k), dy = _mm_load_ps(p.dy + k), dz = _mm_load_ps(p.dz + k);
+
+        // pvec = cross(dir, e2)
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 inv_det = _mm_div_ps(one, det);
+
+        // tvec = orig - v0
+        const __m128 tx = _mm_sub_ps(_mm_load_ps(p.ox + k), v0x);
+        const __m128 ty = _mm_sub_ps(_mm_load_ps(p.oy + k), v0y);
+        const __m128 tz = _mm_sub_ps(_mm_load_ps(p.oz + k), v0z);
+
+        const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+        // qvec = cross(tvec, e1)
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+        const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+        const __m128 tmax = _mm_load_ps(p.t_max + k);
+
+        __m128 b_hit = _mm_cmpneq_ps(det, zero);
+        b_hit = _mm_and_ps(b_hit, _mm_cmpge_ps(u, zero));
+        b_hit = _mm_and_ps(b_hit, _mm_cmple_ps(u, one));
+        b_hit = _mm_and_ps(b_hit, _mm_cmpge_ps(v, zero));
+        b_hit = _mm_and_ps(b_hit, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        b_hit = _mm_and_ps(b_hit, _mm_cmpgt_ps(t, tmin));
+        b_hit = _mm_and_ps(b_hit, _mm_cmplt_ps(t, tmax));
+        const int mask = _mm_movemask_ps(b_hit);
+        if(!mask)
+            continue;
+
+        _mm_store_ps(p.t_max + k, _mm_or_ps(_mm_and_ps(b_hit, t), _mm_andnot_ps(b_hit, tmax)));
+        for(int i=0; i<4; ++i) {
+            if(mask & (1 << i)) {
+                p.obj[k + i] = obj_id;
+                p.prim[k + i] = b.tri_id[lane];
+            }
+        }
+    }
+#else
+    mesh_triangle tri;
+    tri.v0 = vec3(b.v0x[lane], b.v0y[lane], b.v0z[lane]);
+    tri.e1 = vec3(b.e1x[lane], b.e1y[lane], b.e1z[lane]);
+    tri.e2 = vec3(b.e2x[lane], b.e2y[lane], b.e2z[lane]);
+    for(int k = first; k < end; ++k) {
+        Real t, u, v;
+        if(ray_tri_intersect(vec3(p.ox[k], p.oy[k], p.oz[k]), vec3(p.dx[k], p.dy[k], p.dz[k]),
+                             tri, t_min, p.t_max[k], &t, &u, &v)) {
+            p.t_max[k] = t;
+            p.obj[k] = obj_id;
+            p.prim[k] = b.tri_id[lane];
+        }
+    }
+#endif
+}
+
+void mesh::intersect_packet(ray_packet& p, int first, int end, Real t_min, int32_t obj_id) const {
+
+    const mapped_array<bvh_node>& nodes = accel.get_nodes();
+    accel.intersect_packet(p, first, end, t_min, [&](int32_t node_idx, int leaf_first, int leaf_end) {
+        const int32_t first_block = leaf_blocks[node_idx];
+        const int count = nodes[node_idx].count;
+        for(int i = 0; i < count; ++i) {
+            packet_tri_intersect(p, leaf_first, leaf_end, blocks[first_block + i / kTriBlockWidth],
+                                 i % kTriBlockWidth, t_min, obj_id);
+        }
+    });
+}
+
+void mesh_instance::intersect_packet(ray_packet& p, int first, int end, Real t_min, int32_t obj_id) const {
+
+    if(b_identity) {
+        geometry->intersect_packet(p, first, end, t_min, obj_id);
+        return;
     }
 
-    return b_intersected;
+    // whole packet is transformed so the object space one gets its own
+    // inverse directions and interval bounds
+    ray_packet obj_p;
+    for(int i=0; i<p.num_rays; ++i) {
+        obj_p.set_ray(i, to_object(p.get_ray(i)));
+    }
+    obj_p.finalize(p.num_rays);
+    for(int i=0; i<kPacketSize; ++i) {
+        obj_p.t_max[i] = p.t_max[i];
+        obj_p.obj[i] = p.obj[i];
+        obj_p.prim[i] = p.prim[i];
+    }
 
+    geometry->intersect_packet(obj_p, first, end, t_min, obj_id);
+
+    // tests run 4 rays at a time and may update neighbours of the range too
+    for(int i=0; i<kPacketSize; ++i) {
+        p.t_max[i] = obj_p.t_max[i];
+        p.obj[i] = obj_p.obj[i];
+        p.prim[i] = obj_p.prim[i];
+    }
 }
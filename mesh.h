@@ -2,8 +2,48 @@
 
 #include "config.h"
 #include "hit.h"
-#include "material.h"
 #include "ray.h"
+#include "bvh.h"
+#include "tri_block.h"
+#include "transform.h"
+
+#include <memory>
+#include <vector>
+
+// Triangle prepared for Moller-Trumbore test, built once per mesh so the hot
+// loop does not go through obj indices
+struct mesh_triangle {
+    vec3 v0;
+    vec3 e1; // v1 - v0
+    vec3 e2; // v2 - v0
+    // shading normal, normal of the first vertex (flat normals are assumed)
+    // or geometric one when obj has no normals
+    vec3 n;
+};
+
+// Returns distance and barycentrics of the hit inside (t_min, t_max)
+INLINE bool ray_tri_intersect(const vec3 &orig, const vec3 &dir, const mesh_triangle& tri,
+                              Real t_min, Real t_max, Real* t, Real* u, Real* v) {
+    const vec3 pvec = cross(dir, tri.e2);
+    const Real det = dot(tri.e1, pvec);
+    // ray is parallel to the triangle plane
+    if(det == Real(0))
+        return false;
+    const Real inv_det = Real(1) / det;
+
+    const vec3 tvec = orig - tri.v0;
+    *u = dot(tvec, pvec) * inv_det;
+    if(*u < Real(0) || *u > Real(1))
+        return false;
+
+    const vec3 qvec = cross(tvec, tri.e1);
+    *v = dot(dir, qvec) * inv_det;
+    if(*v < Real(0) || *u + *v > Real(1))
+        return false;
+
+    *t = dot(tri.e2, qvec) * inv_det;
+    return *t > t_min && *t < t_max;
+}
 
 class mesh {
     public:
@@ -11,14 +51,105 @@ class mesh {
     mesh(const mesh&) = delete;
     mesh(mesh&&) = delete;
 
-    mesh(const struct ObjFile* obj, const material& m);
+    // Geometry only, materials are given by instances. Obj is shared with
+    // other users (see asset_cache). Hierarchy is built later by
+    // build_accels(), together with other meshes.
+    explicit mesh(std::shared_ptr<const struct ObjFile> obj);
+    // uses prebuilt hierarchy instead of building one
+    mesh(std::shared_ptr<const struct ObjFile> obj, bvh&& prebuilt);
+    // builds hierarchies of all given meshes which do not have one yet, in
+    // parallel on the pool if given
+    static void build_accels(mesh* const* meshes, int count, class thread_pool* pool,
+                             bvh_build_method method);
+    bool has_accel() const { return b_accel_built; }
+    // Moves vertices to p (indexed like obj positions) and refits the
+    // hierarchy. Shading normals are taken from n (indexed like obj normals)
+    // or computed per face when n is null. Returns false if the refitted
+    // hierarchy got too slow to trace, it is then dropped and has to be
+    // rebuilt by build_accels().
+    bool update_vertices(const std::vector<vec3>& p, const std::vector<vec3>* n);
+    const std::shared_ptr<const struct ObjFile>& get_obj() const { return obj_model; }
+    int get_num_triangles() const { return (int)tris.size(); }
+    // closest triangle in (t_min, t_max) without any hit attributes
+    bool intersect(const ray &r, Real t_min, Real t_max, Real* t, int32_t* tri) const;
+    // fills hit attributes except material once t and tri are known to be
+    // the closest hit
+    void finalize_hit(const ray &r, Real t, int32_t tri, hit_info &rec) const {
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.normal = tris[tri].n;
+    }
     bool hit(const ray &r, Real t_min, Real t_max, hit_info &rec) const;
-    const material& get_material() const { return mat; }
+    // any hit in (t_min, t_max), for shadow rays
+    bool occluded(const ray &r, Real t_min, Real t_max) const;
+    // closest hits for rays [first, end) of a packet, records obj_id and
+    // triangle index for rays which hit the mesh closer than their t_max
+    void intersect_packet(ray_packet& p, int first, int end, Real t_min, int32_t obj_id) const;
+    const mesh_triangle& get_triangle(int32_t i) const { return tris[i]; }
+    const bvh& get_bvh() const { return accel; }
+    aabb get_bounds() const { return accel.empty() ? aabb() : accel.get_bounds(); }
 
-    ~mesh();
     private:
+    // p and normals are indexed like in obj, normals may be null
+    void build_triangles(const vec3* p, const vec3* normals);
+    void build_blocks();
 
-    const struct ObjFile* obj_model;
-    material mat;
+    std::shared_ptr<const struct ObjFile> obj_model;
+    // indexed the same way as faces of obj_model
+    std::vector<mesh_triangle> tris;
+    // built by build_accels() or taken prebuilt and refitted when vertices
+    // move, leafs reference triangle indices
+    bvh accel;
+    bool b_accel_built = false;
+    // triangles of every leaf packed into SIMD blocks in leaf order
+    std::vector<tri_block> blocks;
+    // first block of a leaf, indexed by bvh node
+    std::vector<int32_t> leaf_blocks;
 };
 
+// Placement of mesh geometry in the scene. Any number of instances share one
+// mesh and its hierarchy, each with its own transform and material. Rays are
+// moved into object space for traversal, their direction is not normalized
+// there so hit distances are the same in both spaces.
+struct mesh_instance {
+    const mesh* geometry;
+    int32_t mat_id;
+    mat4 object_to_world;
+    mat4 world_to_object;
+    // plain <mesh> elements, rays are passed through as they are
+    bool b_identity;
+
+    // object_to_world has to be invertible
+    mesh_instance(const mesh* g, int32_t m, const mat4& to_world)
+        :geometry(g), mat_id(m), object_to_world(to_world), world_to_object(mat4::identity()),
+         b_identity(to_world.is_identity()) {
+        affine_inverse(to_world, &world_to_object);
+    }
+
+    ray to_object(const ray& r) const {
+        return ray(world_to_object.transform_point(r.orig), world_to_object.transform_vector(r.dir));
+    }
+
+    aabb get_bounds() const {
+        const aabb b = geometry->get_bounds();
+        return b_identity ? b : transform_bounds(object_to_world, b);
+    }
+
+    bool intersect(const ray &r, Real t_min, Real t_max, Real* t, int32_t* tri) const {
+        return geometry->intersect(b_identity ? r : to_object(r), t_min, t_max, t, tri);
+    }
+
+    bool occluded(const ray &r, Real t_min, Real t_max) const {
+        return geometry->occluded(b_identity ? r : to_object(r), t_min, t_max);
+    }
+
+    // r is the world space ray
+    void finalize_hit(const ray &r, Real t, int32_t tri, hit_info &rec) const {
+        geometry->finalize_hit(r, t, tri, rec);
+        if(!b_identity)
+            rec.normal = normalize(world_to_object.transform_vector_transposed(rec.normal));
+        rec.mat_id = mat_id;
+    }
+
+    void intersect_packet(ray_packet& p, int first, int end, Real t_min, int32_t obj_id) const;
+};
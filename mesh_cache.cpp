@@ -0,0 +1,289 @@
+#include "mesh_cache.h"
+#include "mapped_file.h"
+#include "obj_loader.h"
+#include "bvh.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+// bump whenever layout of cached data (including bvh_node) changes
+const uint32_t kVersion = 3;
+// bytes hashed at the beginning and at the end of the obj file
+const size_t kHashSampleSize = 64 << 10;
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t vec3_size;
+    uint32_t face_size;
+    uint32_t node_size;
+    uint32_t bvh_method;
+
+    // key
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t src_hash;
+
+    uint64_t num_p;
+    uint64_t num_n;
+    uint64_t num_faces;
+    uint64_t num_nodes;
+    uint64_t num_prims;
+    // offsets of sections from the beginning of the file
+    uint64_t offs_p;
+    uint64_t offs_n;
+    uint64_t offs_faces;
+    uint64_t offs_nodes;
+    uint64_t offs_prims;
+};
+
+struct source_key {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+};
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t h = 14695981039346656037ULL) {
+    const uint8_t* p = (const uint8_t*)data;
+    for(size_t i=0; i<size; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Size and mtime catch normal edits, hash of the head and tail of the file
+// catches files replaced while keeping size and time stamp.
+bool get_source_key(const char* obj_filename, source_key* key) {
+
+    struct stat st;
+    if(stat(obj_filename, &st) != 0)
+        return false;
+
+    key->size = (uint64_t)st.st_size;
+    key->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    key->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+
+    FILE* fh = fopen(obj_filename, "rb");
+    if(!fh)
+        return false;
+
+    std::vector<uint8_t> buf(kHashSampleSize);
+    size_t n = fread(buf.data(), 1, buf.size(), fh);
+    uint64_t h = fnv1a(buf.data(), n);
+    if(key->size > 2 * kHashSampleSize) {
+        fseek(fh, -(long)kHashSampleSize, SEEK_END);
+        n = fread(buf.data(), 1, buf.size(), fh);
+        h = fnv1a(buf.data(), n, h);
+    }
+    fclose(fh);
+
+    key->hash = h;
+    return true;
+}
+
+std::string get_cache_filename(const char* obj_filename, const std::string& cache_dir) {
+
+    if(cache_dir.empty())
+        return std::string(obj_filename) + ".rtmesh";
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.rtmesh",
+             (unsigned long long)fnv1a(obj_filename, strlen(obj_filename)));
+    std::string filename = cache_dir;
+    if(filename.back() != '/')
+        filename.push_back('/');
+    return filename + name;
+}
+
+uint64_t align16(uint64_t v) {
+    return (v + 15) & ~uint64_t(15);
+}
+
+template <typename T>
+bool section_in_range(const mapped_file& mf, uint64_t offs, uint64_t count) {
+    return offs <= mf.size() && offs % alignof(T) == 0 && count <= (mf.size() - offs) / sizeof(T);
+}
+
+// Contents are used as read, so a file damaged without touching its key
+// must not get through. Builders place children after their parent, which
+// also rules out cycles and lets depth be checked in the same pass.
+bool contents_valid(const cache_header& h, const ObjVertexId* faces, const bvh_node* nodes,
+                    const int32_t* prims) {
+
+    if(h.num_faces % 3 || (h.num_faces && !h.num_nodes))
+        return false;
+
+    for(uint64_t i=0; i<h.num_faces; ++i) {
+        const ObjVertexId& f = faces[i];
+        if(f.p < 1 || (uint64_t)f.p > h.num_p || f.n < 0 || (uint64_t)f.n > h.num_n)
+            return false;
+    }
+
+    std::vector<uint8_t> depth(h.num_nodes, 0);
+    for(uint64_t i=0; i<h.num_nodes; ++i) {
+        const bvh_node& n = nodes[i];
+        if(n.count < 0 || n.first < 0)
+            return false;
+        if(n.is_leaf()) {
+            if((uint64_t)n.first + (uint64_t)n.count > h.num_prims)
+                return false;
+            continue;
+        }
+        if((uint64_t)n.first <= i || (uint64_t)n.first + 1 >= h.num_nodes || depth[i] + 1 >= bvh::kMaxDepth)
+            return false;
+        depth[n.first] = depth[n.first + 1] = depth[i] + 1;
+    }
+
+    for(uint64_t i=0; i<h.num_prims; ++i) {
+        if(prims[i] < 0 || (uint64_t)prims[i] >= h.num_faces / 3)
+            return false;
+    }
+    return true;
+}
+
+}
+
+bool mesh_cache_load(const char* obj_filename, const std::string& cache_dir,
+                     bvh_build_method method, ObjFile** obj, bvh* accel) {
+
+    source_key key;
+    if(!get_source_key(obj_filename, &key))
+        return false;
+
+    // Arrays are used in place, the file stays mapped as long as the obj or
+    // hierarchy refers to it. Stores replace cache files by rename, so
+    // a mapped file is never truncated under us.
+    const std::string cache_filename = get_cache_filename(obj_filename, cache_dir);
+    std::shared_ptr<mapped_file> file = std::make_shared<mapped_file>();
+    const mapped_file& mf = *file;
+    if(!file->open(cache_filename.c_str(), false) || mf.size() < sizeof(cache_header))
+        return false;
+
+    cache_header h;
+    memcpy(&h, mf.data(), sizeof(h));
+    if(memcmp(h.magic, kMagic, sizeof(kMagic)) || h.version != kVersion ||
+       h.vec3_size != sizeof(vec3) || h.face_size != sizeof(ObjVertexId) ||
+       h.node_size != sizeof(bvh_node) || h.bvh_method != (uint32_t)method)
+        return false;
+
+    if(h.src_size != key.size || h.src_mtime_sec != key.mtime_sec ||
+       h.src_mtime_nsec != key.mtime_nsec || h.src_hash != key.hash)
+        return false;
+
+    if(!section_in_range<vec3>(mf, h.offs_p, h.num_p) ||
+       !section_in_range<vec3>(mf, h.offs_n, h.num_n) ||
+       !section_in_range<ObjVertexId>(mf, h.offs_faces, h.num_faces) ||
+       !section_in_range<bvh_node>(mf, h.offs_nodes, h.num_nodes) ||
+       !section_in_range<int32_t>(mf, h.offs_prims, h.num_prims)) {
+        printf("Corrupted mesh cache: %s\n", cache_filename.c_str());
+        return false;
+    }
+
+    const vec3* p = (const vec3*)(mf.data() + h.offs_p);
+    const vec3* n = (const vec3*)(mf.data() + h.offs_n);
+    const ObjVertexId* faces = (const ObjVertexId*)(mf.data() + h.offs_faces);
+    const bvh_node* nodes = (const bvh_node*)(mf.data() + h.offs_nodes);
+    const int32_t* prims = (const int32_t*)(mf.data() + h.offs_prims);
+    if(!contents_valid(h, faces, nodes, prims)) {
+        printf("Corrupted mesh cache: %s\n", cache_filename.c_str());
+        return false;
+    }
+
+    ObjFile* o = new ObjFile;
+    o->p.map(file, p, h.num_p);
+    o->n.map(file, n, h.num_n);
+    o->faces.map(file, faces, h.num_faces);
+
+    mapped_array<bvh_node> mapped_nodes;
+    mapped_array<int32_t> mapped_prims;
+    mapped_nodes.map(file, nodes, h.num_nodes);
+    mapped_prims.map(file, prims, h.num_prims);
+    accel->set_data(std::move(mapped_nodes), std::move(mapped_prims), method);
+
+    *obj = o;
+    return true;
+}
+
+bool mesh_cache_store(const char* obj_filename, const std::string& cache_dir,
+                      const ObjFile& obj, const bvh& accel) {
+
+    source_key key;
+    if(!get_source_key(obj_filename, &key))
+        return false;
+
+    cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.vec3_size = sizeof(vec3);
+    h.face_size = sizeof(ObjVertexId);
+    h.node_size = sizeof(bvh_node);
+    h.bvh_method = (uint32_t)accel.get_build_method();
+    h.src_size = key.size;
+    h.src_mtime_sec = key.mtime_sec;
+    h.src_mtime_nsec = key.mtime_nsec;
+    h.src_hash = key.hash;
+
+    h.num_p = obj.p.size();
+    h.num_n = obj.n.size();
+    h.num_faces = obj.faces.size();
+    h.num_nodes = accel.get_nodes().size();
+    h.num_prims = accel.get_prim_indices().size();
+
+    h.offs_p = align16(sizeof(h));
+    h.offs_n = align16(h.offs_p + h.num_p * sizeof(vec3));
+    h.offs_faces = align16(h.offs_n + h.num_n * sizeof(vec3));
+    h.offs_nodes = align16(h.offs_faces + h.num_faces * sizeof(ObjVertexId));
+    h.offs_prims = align16(h.offs_nodes + h.num_nodes * sizeof(bvh_node));
+    const uint64_t total_size = h.offs_prims + h.num_prims * sizeof(int32_t);
+
+    std::vector<char> data(total_size, 0);
+    memcpy(data.data(), &h, sizeof(h));
+    memcpy(data.data() + h.offs_p, obj.p.data(), h.num_p * sizeof(vec3));
+    memcpy(data.data() + h.offs_n, obj.n.data(), h.num_n * sizeof(vec3));
+    memcpy(data.data() + h.offs_faces, obj.faces.data(), h.num_faces * sizeof(ObjVertexId));
+    memcpy(data.data() + h.offs_nodes, accel.get_nodes().data(), h.num_nodes * sizeof(bvh_node));
+    memcpy(data.data() + h.offs_prims, accel.get_prim_indices().data(), h.num_prims * sizeof(int32_t));
+
+    // write to a temporary and rename so concurrent jobs never see a partial file
+    const std::string cache_filename = get_cache_filename(obj_filename, cache_dir);
+    char tmp_filename[1024];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.%d.tmp", cache_filename.c_str(), (int)getpid());
+
+    FILE* fh = fopen(tmp_filename, "wb");
+    if(!fh) {
+        printf("Cannot write mesh cache: %s\n", cache_filename.c_str());
+        return false;
+    }
+    bool b_ok = fwrite(data.data(), 1, data.size(), fh) == data.size();
+    b_ok &= fclose(fh) == 0;
+    if(b_ok) {
+        b_ok = rename(tmp_filename, cache_filename.c_str()) == 0;
+    }
+    if(!b_ok) {
+        printf("Cannot write mesh cache: %s\n", cache_filename.c_str());
+        remove(tmp_filename);
+    }
+    return b_ok;
+}
+
+std::string mesh_cache_source_id(const char* obj_filename) {
+
+    source_key key;
+    if(!get_source_key(obj_filename, &key))
+        return std::string();
+
+    char id[80];
+    snprintf(id, sizeof(id), "%llx:%lld.%09lld:%016llx", (unsigned long long)key.size,
+             (long long)key.mtime_sec, (long long)key.mtime_nsec, (unsigned long long)key.hash);
+    return id;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <string>
+
+struct ObjFile;
+
+// Binary copy of a parsed obj file together with its prebuilt BVH. Cache
+// files are stored next to the obj (<file>.rtmesh) or, when cache_dir is not
+// empty, in that directory under a name derived from the obj path. They are
+// only valid for the same obj size, modification time and sampled content
+// hash and use native endianness.
+
+// returns false if there is no valid cache entry for obj_filename with BVH
+// built by the given method, arrays of obj and accel refer to the mapped
+// file instead of copies
+bool mesh_cache_load(const char* obj_filename, const std::string& cache_dir,
+                     bvh_build_method method, ObjFile** obj, bvh* accel);
+
+bool mesh_cache_store(const char* obj_filename, const std::string& cache_dir,
+                      const ObjFile& obj, const bvh& accel);
+
+// the same size, time stamp and hash as text, files with equal ids are
+// treated as equal, empty if the file cannot be read
+std::string mesh_cache_source_id(const char* obj_filename);
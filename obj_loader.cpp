@@ -1,93 +1,411 @@
 #include "obj_loader.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
 
-static bool read_vec3(const char* line, float* p)
+// Parsing works directly on the mapped file which is not null terminated,
+// so every routine gets the end of the current line and never reads past it.
+
+static INLINE bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static INLINE const char* skip_blanks(const char* s, const char* end) {
+    while(s < end && is_blank(*s)) s++;
+    return s;
+}
+
+static INLINE bool is_digit(char c) {
+    return (unsigned)(c - '0') < 10u;
+}
+
+static bool parse_float(const char*& s, const char* end, float* value)
 {
-    return 3 == sscanf(line, "%f %f %f", p, p+1, p+2);
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const int max_pow10 = (int)(sizeof(pow10) / sizeof(pow10[0])) - 1;
+
+    s = skip_blanks(s, end);
+
+    bool b_negative = false;
+    if(s < end && (*s == '-' || *s == '+')) {
+        b_negative = *s == '-';
+        s++;
+    }
+
+    // keep up to 19 significant digits, enough for any float
+    uint64_t mantissa = 0;
+    int num_digits = 0;
+    int exponent = 0;
+    bool b_any_digit = false;
+    for(; s < end && is_digit(*s); ++s) {
+        b_any_digit = true;
+        if(num_digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+            if(mantissa) num_digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if(s < end && *s == '.') {
+        s++;
+        for(; s < end && is_digit(*s); ++s) {
+            b_any_digit = true;
+            if(num_digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+                if(mantissa) num_digits++;
+                exponent--;
+            }
+        }
+    }
+    if(!b_any_digit)
+        return false;
+
+    if(s < end && (*s == 'e' || *s == 'E')) {
+        s++;
+        bool b_neg_exp = false;
+        if(s < end && (*s == '-' || *s == '+')) {
+            b_neg_exp = *s == '-';
+            s++;
+        }
+        if(s >= end || !is_digit(*s))
+            return false;
+        int e = 0;
+        for(; s < end && is_digit(*s); ++s) {
+            if(e < 10000) e = e * 10 + (*s - '0');
+        }
+        exponent += b_neg_exp ? -e : e;
+    }
+
+    // exact powers of ten keep the result correctly rounded for the usual
+    // fixed point numbers found in obj files
+    double v = (double)mantissa;
+    if(mantissa) {
+        if(exponent < 0) {
+            while(exponent < -max_pow10) { v /= pow10[max_pow10]; exponent += max_pow10; }
+            v /= pow10[-exponent];
+        } else if(exponent > 0) {
+            while(exponent > max_pow10) { v *= pow10[max_pow10]; exponent -= max_pow10; }
+            v *= pow10[exponent];
+        }
+    }
+
+    *value = (float)(b_negative ? -v : v);
+    return true;
 }
 
-static bool read_vec2(const char* line, float* p)
+static bool parse_int(const char*& s, const char* end, int32_t* value)
 {
-   return 2 == sscanf(line, "%f %f", p, p+1);
+    bool b_negative = false;
+    if(s < end && (*s == '-' || *s == '+')) {
+        b_negative = *s == '-';
+        s++;
+    }
+    if(s >= end || !is_digit(*s))
+        return false;
+
+    int64_t v = 0;
+    for(; s < end && is_digit(*s); ++s) {
+        v = v * 10 + (*s - '0');
+        if(v > INT32_MAX)
+            return false;
+    }
+    *value = (int32_t)(b_negative ? -v : v);
+    return true;
 }
 
-static bool read_face(const char* line, int32_t* face)
+static bool read_floats(const char* s, const char* end, float* p, int count)
 {
-    while(!isdigit(*line)) line++;
-    int num_read = 0;
+    for(int i=0; i<count; ++i) {
+        if(!parse_float(s, end, p + i))
+            return false;
+    }
+    return true;
+}
+
+// files smaller than this are not worth splitting between threads
+static const size_t kParallelMinSize = 16 << 20;
+static const size_t kMinChunkSize = 4 << 20;
+
+// arrays of ObjFile while they are being parsed
+struct obj_data {
+    std::vector<vec3> p;
+    std::vector<vec3> n;
+    std::vector<ObjVertexId> faces;
+};
+
+// Newline aligned part of the file parsed independently of the others.
+// Relative (negative) indices can only be resolved against vertices of the
+// chunk itself, those which point before its start are fixed up on merge.
+struct obj_chunk {
+    const char* begin;
+    const char* end;
+    obj_data data;
+    // positions in data.faces with p/n relative to the start of the chunk
+    std::vector<size_t> relative_p;
+    std::vector<size_t> relative_n;
+    int num_lines = 0;
+    // 1-based line in the chunk which failed to parse, 0 if none
+    int error_line = 0;
+};
+
+// converts relative (negative) obj index into 1-based one counted from the
+// beginning of the chunk, 0 stays "no index"
+static INLINE int32_t resolve_index(int32_t idx, size_t count) {
+    return idx < 0 ? (int32_t)count + idx + 1 : idx;
+}
+
+// Reads "p", "p/t", "p//n" or "p/t/n" vertex references and triangulates
+// polygons as a fan around the first vertex
+static bool read_face(const char* s, const char* end, obj_chunk* chunk)
+{
+    obj_data* obj = &chunk->data;
+    ObjVertexId first(0, 0), prev(0, 0);
+    bool first_rel_p = false, first_rel_n = false;
+    bool prev_rel_p = false, prev_rel_n = false;
     int count = 0;
-    do {
-        num_read = sscanf(line, "%d", face);
-        // skip to next number or next triplet
-        while(*line!='/' && *line!=' ' && *line!='\n' && *line!='\0') line++;
-        // increment face
-        while(*line=='/' || *line==' ') { line++; face++; }
-        count += num_read>0 ? 1 : 0;
-    } while(num_read>0);
-
-    return count > 0;
+    while(true) {
+        s = skip_blanks(s, end);
+        if(s >= end)
+            break;
+
+        int32_t p = 0, t = 0, n = 0;
+        if(!parse_int(s, end, &p))
+            return false;
+        if(s < end && *s == '/') {
+            s++;
+            if(s < end && *s != '/' && !parse_int(s, end, &t))
+                return false;
+            if(s < end && *s == '/') {
+                s++;
+                if(!parse_int(s, end, &n))
+                    return false;
+            }
+        }
+        if(s < end && !is_blank(*s))
+            return false;
+
+        ObjVertexId v(resolve_index(p, obj->p.size()), resolve_index(n, obj->n.size()));
+        const bool rel_p = p < 0, rel_n = n < 0;
+        if(count == 0) {
+            first = v;
+            first_rel_p = rel_p;
+            first_rel_n = rel_n;
+        } else if(count >= 2) {
+            const ObjVertexId tri[3] = { first, prev, v };
+            const bool tri_rel_p[3] = { first_rel_p, prev_rel_p, rel_p };
+            const bool tri_rel_n[3] = { first_rel_n, prev_rel_n, rel_n };
+            for(int i=0; i<3; ++i) {
+                if(tri_rel_p[i]) chunk->relative_p.push_back(obj->faces.size());
+                if(tri_rel_n[i]) chunk->relative_n.push_back(obj->faces.size());
+                obj->faces.push_back(tri[i]);
+            }
+        }
+        prev = v;
+        prev_rel_p = rel_p;
+        prev_rel_n = rel_n;
+        count++;
+    }
+
+    return count >= 3;
 }
 
-ObjFile* load_obj_from_file(const char* file)
+static INLINE const char* find_line_end(const char* s, const char* end) {
+    const char* nl = (const char*)memchr(s, '\n', end - s);
+    return nl ? nl : end;
+}
+
+// counting pre-pass so that vectors are allocated once
+static void count_records(const char* s, const char* end, size_t* num_p,
+                          size_t* num_n, size_t* num_f)
 {
-    FILE* fh = fopen(file, "r");
-    if(!fh) 
-        return nullptr;
+    *num_p = *num_n = *num_f = 0;
+    while(s < end) {
+        const char* line_end = find_line_end(s, end);
+        if(line_end - s > 2) {
+            if(s[0] == 'v' && is_blank(s[1])) (*num_p)++;
+            else if(s[0] == 'v' && s[1] == 'n' && is_blank(s[2])) (*num_n)++;
+            else if(s[0] == 'f' && is_blank(s[1])) (*num_f)++;
+        }
+        s = line_end + 1;
+    }
+}
 
-    ObjFile* obj = new ObjFile;
+static void parse_chunk(obj_chunk* chunk)
+{
+    const char* s = chunk->begin;
+    const char* end = chunk->end;
+    obj_data* obj = &chunk->data;
+
+    size_t num_p, num_n, num_f;
+    count_records(s, end, &num_p, &num_n, &num_f);
+    obj->p.reserve(num_p);
+    obj->n.reserve(num_n);
+    obj->faces.reserve(3 * num_f);
 
-    char buf[1024];
     bool is_ok = true;
-    while(fgets(buf, 1023, fh))
-    {
+    int line_no = 0;
+    for(; s < end && is_ok; ) {
+        const char* line_end = find_line_end(s, end);
+        const char* line = s;
+        s = line_end + 1;
+        line_no++;
+
         float f[3];
-        if(buf[0] == '#') 
+        if(line_end - line < 2 || line[0] == '#')
             continue;
 
-        if(buf[0] == 'v' && buf[1]==' ') {
-            is_ok = read_vec3(buf+1, f);
-            if(!is_ok)
-                break;
-            obj->p.push_back(vec3(f[0], f[1], f[2]));
+        if(line[0] == 'v' && is_blank(line[1])) {
+            is_ok = read_floats(line + 1, line_end, f, 3);
+            if(is_ok)
+                obj->p.push_back(vec3(f[0], f[1], f[2]));
             continue;
         }
 
-        if(buf[0] == 'v' && buf[1]=='t' && buf[2]==' ') {
-            is_ok = read_vec2(buf+2, f);
-            if(!is_ok)
-                break;
+        if(line[0] == 'v' && line[1]=='t' && line_end - line > 2 && is_blank(line[2])) {
+            is_ok = read_floats(line + 2, line_end, f, 2);
             continue;
         }
 
-        if(buf[0] == 'v' && buf[1]=='n' && buf[2]==' ') {
-            is_ok = read_vec3(buf+2, f);
-            if(!is_ok)
-                break;
-            vec3 n = normalize(vec3(f[0], f[1], f[2]));
-            obj->n.push_back(n);
+        if(line[0] == 'v' && line[1]=='n' && line_end - line > 2 && is_blank(line[2])) {
+            is_ok = read_floats(line + 2, line_end, f, 3);
+            if(is_ok)
+                obj->n.push_back(normalize(vec3(f[0], f[1], f[2])));
             continue;
         }
 
-        if(buf[0] == 'f' && buf[1]==' ') {
-            int32_t i[9] = {0}; // 0 - no index, as all indices in obj start from 1
-            is_ok = read_face(buf+1, i);
-            if(!is_ok)
-                break;
-            obj->faces.push_back(ObjVertexId(i[0], i[2]));
-            obj->faces.push_back(ObjVertexId(i[3], i[5]));
-            obj->faces.push_back(ObjVertexId(i[6], i[8]));
+        if(line[0] == 'f' && is_blank(line[1])) {
+            is_ok = read_face(line + 1, line_end, chunk);
             continue;
         }
     }
 
-    if(!is_ok) {
-        delete obj;
-        obj = nullptr;
+    chunk->num_lines = line_no;
+    chunk->error_line = is_ok ? 0 : line_no;
+}
+
+// splits [begin, end) into up to num_chunks pieces, each ending after '\n'
+static std::vector<obj_chunk> split_chunks(const char* begin, const char* end, int num_chunks)
+{
+    std::vector<obj_chunk> chunks;
+    const size_t size = end - begin;
+    const char* s = begin;
+    for(int i=0; i<num_chunks && s < end; ++i) {
+        const char* chunk_end = begin + (size_t)((double)size * (i + 1) / num_chunks);
+        if(chunk_end < s)
+            chunk_end = s;
+        if(i == num_chunks - 1) {
+            chunk_end = end;
+        } else {
+            chunk_end = find_line_end(chunk_end, end);
+            chunk_end = chunk_end < end ? chunk_end + 1 : end;
+        }
+        chunks.emplace_back();
+        chunks.back().begin = s;
+        chunks.back().end = chunk_end;
+        s = chunk_end;
+    }
+    return chunks;
+}
+
+// Index of the first face vertex with position outside [1, p.size()] or
+// normal outside [0, n.size()], -1 if all are valid. Neither the parser nor
+// relative index resolution range check indices, so this is done once on
+// the whole file.
+static int64_t find_bad_index(const ObjFile& obj)
+{
+    const int64_t num_p = (int64_t)obj.p.size();
+    const int64_t num_n = (int64_t)obj.n.size();
+    for(size_t i=0; i<obj.faces.size(); ++i) {
+        const ObjVertexId& v = obj.faces[i];
+        if(v.p < 1 || v.p > num_p || v.n < 0 || v.n > num_n)
+            return (int64_t)i;
     }
+    return -1;
+}
 
-    fclose(fh);
-    return obj;
+// takes ownership of obj, deletes it if it references missing vertices
+static ObjFile* validate_indices(const char* file, ObjFile* obj)
+{
+    const int64_t bad = find_bad_index(*obj);
+    if(bad < 0)
+        return obj;
+    printf("%s: triangle %lld references a missing vertex or normal\n", file, (long long)(bad / 3 + 1));
+    delete obj;
+    return nullptr;
 }
 
+ObjFile* load_obj_from_file(const char* file, thread_pool* pool)
+{
+    mapped_file mf;
+    if(!mf.open(file))
+        return nullptr;
+
+    int num_chunks = 1;
+    if(pool && pool->get_num_threads() > 1 && mf.size() >= kParallelMinSize) {
+        num_chunks = (int)min(mf.size() / kMinChunkSize, (size_t)pool->get_num_threads() * 4);
+    }
 
+    std::vector<obj_chunk> chunks = split_chunks(mf.data(), mf.data() + mf.size(), num_chunks);
+    if(chunks.size() > 1) {
+        pool->parallel_for((int)chunks.size(), [&chunks](int i, int) {
+            parse_chunk(&chunks[i]);
+        });
+    } else if(!chunks.empty()) {
+        parse_chunk(&chunks[0]);
+    }
+
+    int line_base = 0;
+    for(const obj_chunk& c: chunks) {
+        if(c.error_line) {
+            printf("%s:%d: failed to parse obj record\n", file, line_base + c.error_line);
+            return nullptr;
+        }
+        line_base += c.num_lines;
+    }
+
+    // relative indices of the first chunk are already absolute
+    obj_data merged;
+    if(chunks.size() == 1) {
+        merged = std::move(chunks[0].data);
+    } else {
+        // concatenate chunks, indices are 1-based so relative ones only need
+        // counts of preceding chunks added
+        size_t num_p = 0, num_n = 0, num_faces = 0;
+        for(const obj_chunk& c: chunks) {
+            num_p += c.data.p.size();
+            num_n += c.data.n.size();
+            num_faces += c.data.faces.size();
+        }
+        merged.p.reserve(num_p);
+        merged.n.reserve(num_n);
+        merged.faces.reserve(num_faces);
+
+        for(obj_chunk& c: chunks) {
+            const int32_t base_p = (int32_t)merged.p.size();
+            const int32_t base_n = (int32_t)merged.n.size();
+            for(size_t i: c.relative_p) {
+                c.data.faces[i].p += base_p;
+            }
+            for(size_t i: c.relative_n) {
+                c.data.faces[i].n += base_n;
+            }
+            merged.p.insert(merged.p.end(), c.data.p.begin(), c.data.p.end());
+            merged.n.insert(merged.n.end(), c.data.n.begin(), c.data.n.end());
+            merged.faces.insert(merged.faces.end(), c.data.faces.begin(), c.data.faces.end());
+            c.data = obj_data();
+        }
+    }
+
+    ObjFile* obj = new ObjFile;
+    obj->p = std::move(merged.p);
+    obj->n = std::move(merged.n);
+    obj->faces = std::move(merged.faces);
+    return validate_indices(file, obj);
+}
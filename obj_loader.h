@@ -1,4 +1,5 @@
 #include "vec.h"
+#include "mapped_file.h"
 
 #include <vector>
 #include <string>
@@ -16,11 +17,14 @@ struct ObjVertex {
     vec3 n;
 };
 
+// Arrays are parsed into vectors of their own or mapped from mesh cache
 struct ObjFile {
-    std::vector<vec3> p;
-    std::vector<vec3> n;
-    std::vector<ObjVertexId> faces;
+    mapped_array<vec3> p;
+    mapped_array<vec3> n;
+    mapped_array<ObjVertexId> faces;
     std::string material_name;
 };
 
-ObjFile* load_obj_from_file(const char* file);
+// Splits big files into newline aligned chunks parsed on pool threads when
+// pool is given, result is the same as for serial load
+ObjFile* load_obj_from_file(const char* file, class thread_pool* pool = nullptr);
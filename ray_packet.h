@@ -0,0 +1,191 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+#include "ray.h"
+#include "aabb.h"
+
+#include <stdint.h>
+#include <float.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// packets cover square blocks of kPacketDim x kPacketDim pixels
+static const int kPacketDim = 8;
+static const int kPacketSize = kPacketDim * kPacketDim;
+
+// Coherent rays (e.g. primary rays of neighbouring pixels) traced together.
+// Rays are stored as structure of arrays so 4 of them are tested with one SSE
+// instruction. Lanes past num_rays are padding which never hits anything.
+struct ray_packet {
+    alignas(16) float ox[kPacketSize], oy[kPacketSize], oz[kPacketSize];
+    alignas(16) float dx[kPacketSize], dy[kPacketSize], dz[kPacketSize];
+    alignas(16) float ix[kPacketSize], iy[kPacketSize], iz[kPacketSize];
+    // far end of the ray interval, shrinks to the closest hit found so far
+    alignas(16) float t_max[kPacketSize];
+    // object and primitive of the closest hit, -1 if none
+    int32_t obj[kPacketSize];
+    int32_t prim[kPacketSize];
+    int num_rays = 0;
+
+    // bounds of origins and inverse directions of all rays, used to cull
+    // nodes missed by the whole packet with interval arithmetic
+    vec3 orig_min, orig_max;
+    vec3 inv_min, inv_max;
+    // directions share signs on every axis, interval test is valid only then
+    bool b_coherent = false;
+
+    void set_ray(int i, const ray& r) {
+        ox[i] = r.orig.x; oy[i] = r.orig.y; oz[i] = r.orig.z;
+        dx[i] = r.dir.x; dy[i] = r.dir.y; dz[i] = r.dir.z;
+    }
+    ray get_ray(int i) const {
+        return ray(vec3(ox[i], oy[i], oz[i]), vec3(dx[i], dy[i], dz[i]));
+    }
+
+    // to be called once all count rays are set, pads unused lanes and
+    // computes inverse directions and interval bounds
+    void finalize(int count);
+    // clears hits before tracing the packet through the interval (t_min, t_max)
+    void reset_hits(Real t_max);
+};
+
+INLINE void ray_packet::finalize(int count) {
+    num_rays = count;
+    // padding repeats the last ray so it does not widen interval bounds
+    for(int i = count; i < kPacketSize; ++i) {
+        set_ray(i, get_ray(count - 1));
+    }
+
+    orig_min = orig_max = vec3(ox[0], oy[0], oz[0]);
+    inv_min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    inv_max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    bool b_finite = true;
+    for(int i=0; i<kPacketSize; ++i) {
+        const vec3 inv = inv_direction(vec3(dx[i], dy[i], dz[i]));
+        ix[i] = inv.x; iy[i] = inv.y; iz[i] = inv.z;
+
+        const vec3 o(ox[i], oy[i], oz[i]);
+        orig_min = vec3(min(orig_min.x, o.x), min(orig_min.y, o.y), min(orig_min.z, o.z));
+        orig_max = vec3(max(orig_max.x, o.x), max(orig_max.y, o.y), max(orig_max.z, o.z));
+        inv_min = vec3(min(inv_min.x, inv.x), min(inv_min.y, inv.y), min(inv_min.z, inv.z));
+        inv_max = vec3(max(inv_max.x, inv.x), max(inv_max.y, inv.y), max(inv_max.z, inv.z));
+        b_finite &= fabsf(inv.x) <= FLT_MAX && fabsf(inv.y) <= FLT_MAX && fabsf(inv.z) <= FLT_MAX;
+    }
+
+    b_coherent = b_finite &&
+        (inv_min.x > 0 || inv_max.x < 0) &&
+        (inv_min.y > 0 || inv_max.y < 0) &&
+        (inv_min.z > 0 || inv_max.z < 0);
+}
+
+INLINE void ray_packet::reset_hits(Real t) {
+    for(int i=0; i<kPacketSize; ++i) {
+        // padding lanes get empty interval
+        t_max[i] = i < num_rays ? (float)t : -FLT_MAX;
+        obj[i] = -1;
+        prim[i] = -1;
+    }
+}
+
+// lower and upper bound of a product of two intervals
+INLINE void interval_mul(Real a0, Real a1, Real b0, Real b1, Real* lo, Real* hi) {
+    const Real p0 = a0 * b0, p1 = a0 * b1, p2 = a1 * b0, p3 = a1 * b1;
+    *lo = min(min(p0, p1), min(p2, p3));
+    *hi = max(max(p0, p1), max(p2, p3));
+}
+
+// Conservative test whether every ray of a coherent packet misses the box:
+// distances to near and far planes are bounded over all origins and
+// directions at once, if the latest possible entry is after the earliest
+// possible exit no ray can hit.
+INLINE bool packet_misses_aabb(const ray_packet& p, const aabb& b, Real t_min) {
+    Real near_lo = t_min;
+    Real far_hi = FLT_MAX;
+    const Real bmin[3] = { b.pmin.x, b.pmin.y, b.pmin.z };
+    const Real bmax[3] = { b.pmax.x, b.pmax.y, b.pmax.z };
+    const Real omin[3] = { p.orig_min.x, p.orig_min.y, p.orig_min.z };
+    const Real omax[3] = { p.orig_max.x, p.orig_max.y, p.orig_max.z };
+    const Real imin[3] = { p.inv_min.x, p.inv_min.y, p.inv_min.z };
+    const Real imax[3] = { p.inv_max.x, p.inv_max.y, p.inv_max.z };
+    for(int a=0; a<3; ++a) {
+        // all rays enter through the same plane as direction signs match
+        const bool b_positive = imin[a] > 0;
+        const Real near_plane = b_positive ? bmin[a] : bmax[a];
+        const Real far_plane = b_positive ? bmax[a] : bmin[a];
+        Real lo, hi;
+        interval_mul(near_plane - omax[a], near_plane - omin[a], imin[a], imax[a], &lo, &hi);
+        near_lo = max(near_lo, lo);
+        interval_mul(far_plane - omax[a], far_plane - omin[a], imin[a], imax[a], &lo, &hi);
+        far_hi = min(far_hi, hi);
+    }
+    return near_lo > far_hi;
+}
+
+// Slab test of rays [first, first + 4) against a box, returns bit mask of
+// rays which hit it. Same math as ray_aabb_intersect.
+INLINE int packet_aabb_intersect4(const ray_packet& p, int first, const aabb& b, Real t_min) {
+#if defined(__SSE2__)
+    const __m128 ox = _mm_load_ps(p.ox + first), oy = _mm_load_ps(p.oy + first), oz = _mm_load_ps(p.oz + first);
+    const __m128 ix = _mm_load_ps(p.ix + first), iy = _mm_load_ps(p.iy + first), iz = _mm_load_ps(p.iz + first);
+
+    const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmin.x), ox), ix);
+    const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmax.x), ox), ix);
+    const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmin.y), oy), iy);
+    const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmax.y), oy), iy);
+    const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmin.z), oz), iz);
+    const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b.pmax.z), oz), iz);
+
+    const __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)),
+                                 _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps((float)t_min)));
+    const __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)),
+                                 _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_load_ps(p.t_max + first)));
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for(int i=0; i<4; ++i) {
+        const int k = first + i;
+        Real t;
+        if(ray_aabb_intersect(vec3(p.ox[k], p.oy[k], p.oz[k]), vec3(p.ix[k], p.iy[k], p.iz[k]),
+                              b, t_min, p.t_max[k], &t))
+            mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// Narrows active range [*first, *end) of rays to those from the first to the
+// last ray which hit the box, returns false if none does
+INLINE bool packet_clip_range(const ray_packet& p, const aabb& b, Real t_min, int* first, int* end) {
+    if(p.b_coherent && packet_misses_aabb(p, b, t_min))
+        return false;
+
+    // rays are tested in aligned groups of 4, lanes outside of the range are
+    // masked out
+    const int group_end = (*end + 3) & ~3;
+    int new_first = -1;
+    for(int k = *first & ~3; k < group_end; k += 4) {
+        int mask = packet_aabb_intersect4(p, k, b, t_min);
+        if(k < *first)
+            mask &= ~0u << (*first - k);
+        if(mask) {
+            new_first = k + __builtin_ctz(mask);
+            break;
+        }
+    }
+    if(new_first < 0)
+        return false;
+
+    for(int k = group_end - 4; k >= (new_first & ~3); k -= 4) {
+        int mask = packet_aabb_intersect4(p, k, b, t_min);
+        if(k + 4 > *end)
+            mask &= (1 << (*end - k)) - 1;
+        if(mask) {
+            *end = k + 32 - __builtin_clz(mask);
+            break;
+        }
+    }
+    *first = new_first;
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+
+// PCG32 (XSH-RR variant), small state so every pixel sample can own one and
+// results do not depend on which thread renders which pixel
+struct rng {
+    uint64_t state;
+    uint64_t inc;
+
+    rng(uint64_t seed, uint64_t seq) {
+        state = 0;
+        inc = (seq << 1u) | 1u;
+        next_u32();
+        state += seed;
+        next_u32();
+    }
+
+    // seeded from pixel position and sample index
+    static rng for_pixel(uint32_t x, uint32_t y, uint32_t sample) {
+        return rng(mix((uint64_t(y) << 32) | x), sample);
+    }
+
+    uint32_t next_u32() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = (uint32_t)(old >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    // [0,1), uses 24 bits so that the result is never rounded up to 1
+    Real next_real() {
+        return Real(next_u32() >> 8) * Real(1.0 / 16777216.0);
+    }
+
+    // splitmix64 finalizer, spreads neighbouring pixel coordinates apart
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
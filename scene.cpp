@@ -5,19 +5,29 @@
 #include "vec.h"
 #include "obj_loader.h"
 #include "material.h"
+#include "thread_pool.h"
+#include "mesh_cache.h"
+#include "asset_cache.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <map>
+
+namespace {
+
+// assets are shared by obj contents rather than path alone, so a mesh and
+// hierarchy of a file edited since are never paired with the new one
+std::string get_asset_key(const std::string& obj_filename) {
+    return obj_filename + '\n' + mesh_cache_source_id(obj_filename.c_str());
+}
 
-scene::~scene() {
-    for(auto& mesh: meshes) {
-        delete mesh;
-    }
 }
 
-bool scene::load(const char* filename) {
-    
+bool scene::load(const char* filename, const load_options& opts) {
+
     using namespace tinyxml2;
 
     XMLError err = XML_SUCCESS;
@@ -29,6 +39,7 @@ bool scene::load(const char* filename) {
     }
 
     scene_filename = filename;
+    load_opts = opts;
 
 	XMLElement* scene_el = doc.FirstChildElement("scene");
     const char* output_file = nullptr;
@@ -39,6 +50,26 @@ bool scene::load(const char* filename) {
     }
     output_filename = output_file;
 
+    // faster to build but slower to trace hierarchies can be asked for
+    const char* builder = opts.bvh_builder.empty() ? scene_el->Attribute("bvh_builder") : opts.bvh_builder.c_str();
+    bvh_method = kBvhBuildSAH;
+    if(builder && !parse_bvh_build_method(builder, &bvh_method)) {
+        printf("Unknown BVH builder: %s\n", builder);
+        return false;
+    }
+
+    // objects with <animate> element move over this many frames
+    num_frames = 1;
+    const XMLElement* animation_el = scene_el->FirstChildElement("animation");
+    if(animation_el) {
+        float frames;
+        if(!read_named_float_attr(animation_el, "frames", &frames) || frames < 1) {
+            printf("Invalid number of animation frames\n");
+            return false;
+        }
+        num_frames = (int)frames;
+    }
+
     XMLElement* bg_colour = scene_el->FirstChildElement("background_color");
     bool b_success = false;
     color c = read_colour(bg_colour, &b_success);
@@ -51,16 +82,218 @@ bool scene::load(const char* filename) {
     XMLElement* lights_el = scene_el->FirstChildElement("lights");
     b_success &= read_lights(lights_el, &ambient_colour, &lights);
 
+    materials.clear();
     spheres.clear();
+    animated_spheres.clear();
+    animated_meshes.clear();
     XMLElement* surfaces_el = scene_el->FirstChildElement("surfaces");
     b_success &= read_spheres(surfaces_el, &spheres);
 
     meshes.clear();
-    b_success &= read_meshes(surfaces_el, &meshes);
+    instances.clear();
+    std::vector<loaded_mesh> loaded;
+    b_success &= read_meshes(surfaces_el, &meshes, &loaded);
+
+    // only meshes loaded by this scene lack a hierarchy, shared ones are
+    // published complete
+    build_mesh_accels();
+    if(instances.size() > meshes.size()) {
+        printf("%zu mesh instances share %zu meshes\n", instances.size(), meshes.size());
+    }
+    asset_cache& assets = get_asset_cache();
+    for(const loaded_mesh& l: loaded) {
+        if(l.b_uncached && load_opts.b_use_mesh_cache)
+            mesh_cache_store(l.obj_filename.c_str(), load_opts.mesh_cache_dir, *l.m->get_obj(), l.m->get_bvh());
+        // if another scene shared the same mesh meanwhile, ours is used
+        // until it is freed
+        assets.add_mesh(l.asset_key, bvh_method, l.m);
+    }
+
+    b_accel_dirty = true;
+    build_accel();
 
     return b_success;
 }
 
+void scene::build_mesh_accels() {
+
+    std::vector<mesh*> pending;
+    int num_tris = 0;
+    for(const std::shared_ptr<mesh>& m: meshes) {
+        if(!m->has_accel()) {
+            pending.push_back(m.get());
+            num_tris += m->get_num_triangles();
+        }
+    }
+    if(pending.empty())
+        return;
+
+    auto t0 = std::chrono::steady_clock::now();
+    mesh::build_accels(pending.data(), (int)pending.size(), load_opts.pool, bvh_method);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    size_t num_nodes = 0;
+    for(const mesh* m: pending) {
+        num_nodes += m->get_bvh().get_nodes().size();
+    }
+    printf("Built %s BVH of %d meshes (%d triangles): %zu nodes in %.3f s\n",
+           bvh_build_method_name(bvh_method), (int)pending.size(), num_tris, num_nodes, seconds);
+}
+
+void scene::set_frame(int frame, frame_stats* stats) {
+
+    *stats = frame_stats();
+    if(animated_spheres.empty() && animated_meshes.empty())
+        return;
+
+    for(const animated_sphere& as: animated_spheres) {
+        spheres.set_center(as.sphere, as.motion.apply(as.rest_center, frame));
+    }
+
+    std::vector<uint8_t> b_refit(animated_meshes.size());
+    auto update_mesh = [&](int i, int) {
+        const animated_mesh& am = animated_meshes[i];
+        mesh* m = meshes[am.mesh].get();
+        const ObjFile* obj = m->get_obj().get();
+        std::vector<vec3> p(obj->p.size());
+        for(size_t k=0; k<p.size(); ++k) {
+            p[k] = am.motion.apply(obj->p[k], frame);
+        }
+        // deformed meshes get face normals
+        std::vector<vec3> n;
+        if(am.motion.is_rigid()) {
+            n.resize(obj->n.size());
+            for(size_t k=0; k<n.size(); ++k) {
+                n[k] = am.motion.apply_normal(obj->n[k], frame);
+            }
+        }
+        b_refit[i] = m->update_vertices(p, am.motion.is_rigid() ? &n : nullptr);
+    };
+    if(load_opts.pool) {
+        load_opts.pool->parallel_for((int)animated_meshes.size(), update_mesh);
+    } else {
+        for(int i=0; i<(int)animated_meshes.size(); ++i) {
+            update_mesh(i, 0);
+        }
+    }
+    for(uint8_t b: b_refit) {
+        if(b)
+            stats->num_refit_meshes++;
+        else
+            stats->num_rebuilt_meshes++;
+    }
+    build_mesh_accels();
+
+    if(!b_accel_dirty) {
+        std::vector<aabb> bounds;
+        get_object_bounds(&bounds);
+        top_level.refit(bounds.data());
+        if(top_level.get_refit_cost_ratio() <= bvh::kMaxRefitCostRatio)
+            return;
+        b_accel_dirty = true;
+    }
+    stats->b_top_level_rebuilt = true;
+    build_accel();
+}
+
+void scene::get_object_bounds(std::vector<aabb>* bounds) const {
+
+    const int num_spheres = spheres.size();
+    bounds->clear();
+    bounds->reserve(num_spheres + instances.size());
+    for(int i=0; i<num_spheres; ++i) {
+        bounds->push_back(spheres.get(i).get_bounds());
+    }
+    for(const mesh_instance& inst: instances) {
+        bounds->push_back(inst.get_bounds());
+    }
+}
+
+void scene::build_accel() {
+
+    if(!b_accel_dirty)
+        return;
+
+    build_mesh_accels();
+
+    const int num_spheres = spheres.size();
+    std::vector<aabb> bounds;
+    get_object_bounds(&bounds);
+    top_level.build(bounds.data(), (int)bounds.size(), kSphereBatchWidth, bvh_method);
+
+    // renumber spheres in the order leafs reference them, spheres of every
+    // leaf become a contiguous range
+    mapped_array<bvh_node> nodes = top_level.get_nodes();
+    const mapped_array<int32_t>& prims = top_level.get_prim_indices();
+    std::vector<int32_t> objs(prims.begin(), prims.end());
+    std::vector<int32_t> order;
+    order.reserve(num_spheres);
+    for(int32_t& obj: objs) {
+        if(obj < num_spheres) {
+            order.push_back(obj);
+            obj = (int32_t)order.size() - 1;
+        }
+    }
+    spheres.permute(order);
+
+    std::vector<int32_t> new_index(num_spheres);
+    for(int32_t i=0; i<num_spheres; ++i) {
+        new_index[order[i]] = i;
+    }
+    for(animated_sphere& as: animated_spheres) {
+        as.sphere = new_index[as.sphere];
+    }
+
+    top_level_spheres.assign(nodes.size(), leaf_spheres{ 0, 0 });
+    for(size_t i=0; i<nodes.size(); ++i) {
+        const bvh_node& n = nodes[i];
+        leaf_spheres& ls = top_level_spheres[i];
+        for(int32_t k = n.first; k < n.first + n.count; ++k) {
+            if(objs[k] >= num_spheres)
+                continue;
+            if(!ls.num_spheres)
+                ls.first_sphere = objs[k];
+            ls.num_spheres++;
+        }
+    }
+    top_level.set_data(std::move(nodes), std::move(objs), bvh_method);
+
+    b_accel_dirty = false;
+}
+
+void scene::intersect_packet(ray_packet& p, Real t_min, Real t_max, hit_info* hits, bool* b_hits) const {
+
+    if(b_accel_dirty) {
+        for(int i=0; i<p.num_rays; ++i) {
+            b_hits[i] = intersect_linear(p.get_ray(i), t_min, t_max, hits[i]);
+        }
+        return;
+    }
+
+    p.reset_hits(t_max);
+    const int num_spheres = spheres.size();
+    top_level.intersect_packet(p, 0, p.num_rays, t_min, [&](int32_t node_idx, int first, int end) {
+        const leaf_spheres& ls = top_level_spheres[node_idx];
+        spheres_intersect_packet(spheres, ls.first_sphere, ls.num_spheres, p, first, end, t_min);
+
+        const bvh_node& n = top_level.get_nodes()[node_idx];
+        for(int32_t i = n.first; i < n.first + n.count; ++i) {
+            const int32_t obj = top_level.get_prim_indices()[i];
+            if(obj >= num_spheres)
+                instances[obj - num_spheres].intersect_packet(p, first, end, t_min, obj);
+        }
+    });
+
+    for(int i=0; i<p.num_rays; ++i) {
+        const int32_t obj = p.obj[i];
+        b_hits[i] = obj >= 0;
+        if(!b_hits[i])
+            continue;
+
+        finalize_hit(p.get_ray(i), obj, p.prim[i], p.t_max[i], hits[i]);
+    }
+}
+
 bool scene::read_camera(const class tinyxml2::XMLElement* el, scene::camera_params* cp) {
     using namespace tinyxml2;
 
@@ -135,7 +368,7 @@ bool scene::read_lights(const class tinyxml2::XMLElement *el, color* ambient, st
     return b_succes;
 }
 
-bool scene::read_spheres(const class tinyxml2::XMLElement *el, std::vector<sphere>* spheres) {
+bool scene::read_spheres(const class tinyxml2::XMLElement *el, sphere_soa* spheres) {
 
     using namespace tinyxml2;
     bool b_success = true;
@@ -158,7 +391,14 @@ bool scene::read_spheres(const class tinyxml2::XMLElement *el, std::vector<spher
                 printf("Failed reading surfaces: %s:%d\n", __FILE__, __LINE__);
             }
 
-            spheres->emplace_back(pos, Real(radius), mat);
+            spheres->push_back(sphere(pos, Real(radius), add_material(mat)));
+
+            const XMLElement* animate_el = sphere_el->FirstChildElement("animate");
+            if(animate_el) {
+                animated_sphere as = { spheres->size() - 1, pos, object_motion() };
+                b_success &= read_motion(animate_el, pos, &as.motion);
+                animated_spheres.push_back(as);
+            }
 
         } while((sphere_el = sphere_el->NextSiblingElement("sphere")));
     }
@@ -167,10 +407,14 @@ bool scene::read_spheres(const class tinyxml2::XMLElement *el, std::vector<spher
 
 }
 
-bool scene::read_meshes(const class tinyxml2::XMLElement *el, std::vector<mesh*>* meshes) {
+bool scene::read_meshes(const class tinyxml2::XMLElement *el, std::vector<std::shared_ptr<mesh>>* meshes,
+                        std::vector<loaded_mesh>* loaded) {
 
     using namespace tinyxml2;
     bool b_success = true;
+    asset_cache& assets = get_asset_cache();
+    // index of the mesh used for an obj file
+    std::map<std::string, int32_t> shared_meshes;
 
     const XMLElement* mesh_el = el->FirstChildElement("mesh");
     if (mesh_el)
@@ -192,12 +436,6 @@ bool scene::read_meshes(const class tinyxml2::XMLElement *el, std::vector<mesh*>
                 obj_filename = name_attr;
             }
 
-            ObjFile* obj_model = load_obj_from_file(obj_filename.c_str());
-            if(!obj_model) {
-                printf("Failed to load obj model from: %s\n", obj_filename.c_str());
-                return false;
-            }
-
             const XMLElement* material_solid_el = mesh_el->FirstChildElement("material_solid");
             material mat;
             b_success &= read_material_solid(material_solid_el, &mat);
@@ -205,8 +443,56 @@ bool scene::read_meshes(const class tinyxml2::XMLElement *el, std::vector<mesh*>
             if(!b_success) {
                 printf("Failed reading surfaces: %s:%d\n", __FILE__, __LINE__);
             }
+            const int32_t mat_id = add_material(mat);
 
-            meshes->push_back(new mesh(obj_model, mat));
+            mat4 object_to_world = mat4::identity();
+            const XMLElement* transform_el = mesh_el->FirstChildElement("transform");
+            if(transform_el && !read_transform(transform_el, &object_to_world))
+                return false;
+
+            // animated meshes are deformed, so they get a copy of their own
+            const XMLElement* animate_el = mesh_el->FirstChildElement("animate");
+            const auto shared = animate_el ? shared_meshes.end() : shared_meshes.find(obj_filename);
+            if(shared != shared_meshes.end()) {
+                instances.emplace_back((*meshes)[shared->second].get(), mat_id, object_to_world);
+                continue;
+            }
+
+            const std::string asset_key = get_asset_key(obj_filename);
+            std::shared_ptr<mesh> m;
+            if(animate_el) {
+                std::shared_ptr<const ObjFile> obj = assets.get_obj(asset_key, [&]() {
+                    return load_obj(obj_filename);
+                });
+                if(obj)
+                    m = std::make_shared<mesh>(std::move(obj));
+            } else if(!(m = assets.find_mesh(asset_key, bvh_method))) {
+                bool b_uncached = false;
+                m = load_mesh(obj_filename, asset_key, &b_uncached);
+                if(m)
+                    loaded->push_back({ m, obj_filename, asset_key, b_uncached });
+            }
+            if(!m) {
+                printf("Failed to load obj model from: %s\n", obj_filename.c_str());
+                return false;
+            }
+            const ObjFile* obj_model = m->get_obj().get();
+            meshes->push_back(std::move(m));
+
+            instances.emplace_back(meshes->back().get(), mat_id, object_to_world);
+            if(!animate_el)
+                shared_meshes[obj_filename] = (int32_t)meshes->size() - 1;
+
+            // rotates around centre of the mesh unless pivot is given
+            if(animate_el) {
+                aabb rest_bounds;
+                for(const vec3& p: obj_model->p) {
+                    rest_bounds.grow(p);
+                }
+                animated_mesh am = { (int32_t)meshes->size() - 1, object_motion() };
+                b_success &= read_motion(animate_el, rest_bounds.center(), &am.motion);
+                animated_meshes.push_back(am);
+            }
 
         } while((mesh_el = mesh_el->NextSiblingElement("mesh")));
     }
@@ -214,6 +500,132 @@ bool scene::read_meshes(const class tinyxml2::XMLElement *el, std::vector<mesh*>
     return b_success;
 }
 
+std::shared_ptr<mesh> scene::load_mesh(const std::string& obj_filename, const std::string& asset_key,
+                                       bool* b_uncached) {
+
+    ObjFile* cached_obj = nullptr;
+    bvh cached_bvh;
+    if(load_opts.b_use_mesh_cache &&
+       mesh_cache_load(obj_filename.c_str(), load_opts.mesh_cache_dir, bvh_method, &cached_obj, &cached_bvh)) {
+        // obj already held by somebody else is used instead of the cached
+        // copy, unless the file changed between reading its key and the cache
+        std::shared_ptr<const ObjFile> loaded(cached_obj);
+        std::shared_ptr<const ObjFile> obj = get_asset_cache().get_obj(asset_key, [&]() { return loaded; });
+        if(obj->faces.size() != loaded->faces.size())
+            obj = std::move(loaded);
+        return std::make_shared<mesh>(std::move(obj), std::move(cached_bvh));
+    }
+
+    std::shared_ptr<const ObjFile> obj = get_asset_cache().get_obj(asset_key, [&]() {
+        return load_obj(obj_filename);
+    });
+    if(!obj)
+        return nullptr;
+
+    *b_uncached = true;
+    return std::make_shared<mesh>(std::move(obj));
+}
+
+asset_cache& scene::get_asset_cache() const {
+    return load_opts.assets ? *load_opts.assets : asset_cache::global();
+}
+
+std::shared_ptr<const ObjFile> scene::load_obj(const std::string& obj_filename) {
+    return std::shared_ptr<const ObjFile>(load_obj_from_file(obj_filename.c_str(), load_opts.pool));
+}
+
+bool scene::read_motion(const class tinyxml2::XMLElement *el, const point3& default_pivot,
+                        object_motion* motion) {
+
+    using namespace tinyxml2;
+    bool b_success = true;
+    bool b_read = false;
+    *motion = object_motion();
+    motion->pivot = default_pivot;
+
+    const XMLElement* rotation_el = el->FirstChildElement("rotation");
+    if(rotation_el) {
+        b_success &= read_named_float_attr(rotation_el, "degrees_per_frame", &motion->degrees_per_frame);
+        const XMLElement* axis_el = rotation_el->FirstChildElement("axis");
+        if(axis_el) {
+            const vec3 axis = read_vec3(axis_el, &b_read);
+            b_success &= b_read && lengthSqr(axis) > 0;
+            if(lengthSqr(axis) > 0)
+                motion->axis = normalize(axis);
+        }
+        const XMLElement* pivot_el = rotation_el->FirstChildElement("pivot");
+        if(pivot_el) {
+            motion->pivot = read_vec3(pivot_el, &b_read);
+            b_success &= b_read;
+        }
+    }
+
+    const XMLElement* translation_el = el->FirstChildElement("translation");
+    if(translation_el) {
+        motion->translation = read_vec3(translation_el, &b_read);
+        b_success &= b_read;
+    }
+
+    const XMLElement* wave_el = el->FirstChildElement("wave");
+    if(wave_el) {
+        b_success &= read_named_float_attr(wave_el, "amplitude", &motion->wave_amplitude);
+        b_success &= read_named_float_attr(wave_el, "length", &motion->wave_length);
+        b_success &= read_named_float_attr(wave_el, "speed", &motion->wave_speed);
+        b_success &= motion->wave_length > 0;
+    }
+
+    if(!b_success) {
+        printf("Error reading animate element\n");
+    }
+    return b_success;
+}
+
+bool scene::read_transform(const class tinyxml2::XMLElement *el, mat4* m) {
+
+    using namespace tinyxml2;
+    bool b_success = true;
+    *m = mat4::identity();
+    for(const XMLElement* op_el = el->FirstChildElement(); op_el; op_el = op_el->NextSiblingElement()) {
+        mat4 op = mat4::identity();
+        bool b_read = false;
+        if(!strcmp(op_el->Name(), "translate")) {
+            op = mat4::translation(read_vec3(op_el, &b_read));
+        } else if(!strcmp(op_el->Name(), "scale")) {
+            op = mat4::scale(read_vec3(op_el, &b_read));
+        } else if(!strcmp(op_el->Name(), "rotate")) {
+            // around axis x, y, z by angle in degrees
+            const vec3 axis = read_vec3(op_el, &b_read);
+            float angle;
+            b_read &= read_named_float_attr(op_el, "angle", &angle) && lengthSqr(axis) > 0;
+            if(b_read)
+                op = mat4::rotation(normalize(axis), angle);
+        } else if(!strcmp(op_el->Name(), "matrix")) {
+            // 16 values of a row major affine matrix
+            const char* values = op_el->Attribute("values");
+            int count = 0;
+            for(const char* c = values; c && count < 16; ++count) {
+                char* end;
+                op.m[count / 4][count % 4] = strtof(c, &end);
+                if(end == c)
+                    break;
+                c = end;
+            }
+            b_read = count == 16 && op.is_affine();
+        } else {
+            printf("Unknown transform: %s\n", op_el->Name());
+        }
+        b_success &= b_read;
+        *m = op * *m;
+    }
+
+    mat4 inv;
+    if(!b_success || !affine_inverse(*m, &inv)) {
+        printf("Invalid mesh transform\n");
+        return false;
+    }
+    return true;
+}
+
 bool scene::read_material_solid(const class tinyxml2::XMLElement *el, material* mat) {
 
     using namespace tinyxml2;
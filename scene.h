@@ -3,10 +3,14 @@
 #include "config.h"
 #include "vec.h"
 #include "sphere.h"
+#include "sphere_soa.h"
 #include "mesh.h"
 #include "light.h"
 #include "material.h"
+#include "bvh.h"
+#include "animation.h"
 
+#include <memory>
 #include <vector>
 #include <string>
 #include "tinyxml2/tinyxml2.h"
@@ -22,52 +26,185 @@ class scene {
         int res_y;
         int max_bounces;
     };
+    struct load_options {
+        // used to speed up loading of big assets, can be null
+        class thread_pool* pool = nullptr;
+        bool b_use_mesh_cache = true;
+        // empty - cache files are stored next to obj files
+        std::string mesh_cache_dir;
+        // "sah" or "lbvh", overrides bvh_builder attribute of the scene
+        std::string bvh_builder;
+        // meshes are shared with other scenes using the same cache, null -
+        // asset_cache::global()
+        class asset_cache* assets = nullptr;
+    };
+    // what set_frame() had to do to update hierarchies
+    struct frame_stats {
+        int num_refit_meshes = 0;
+        // meshes whose refitted hierarchy got too slow
+        int num_rebuilt_meshes = 0;
+        bool b_top_level_rebuilt = false;
+    };
     private:
-    std::vector<sphere> spheres;
+    sphere_soa spheres;
     std::vector<light> lights;
-    std::vector<mesh*> meshes;
+    // geometry placed by instances, shared with other scenes through the
+    // asset cache unless animated
+    std::vector<std::shared_ptr<mesh>> meshes;
+    std::vector<mesh_instance> instances;
+    // referenced by index from objects and hit_info
+    std::vector<material> materials;
     color ambient_colour;
     color background_colour;
     camera_params cam_params;
     std::string scene_filename;
     std::string output_filename;
+    load_options load_opts;
+
+    // top level hierarchy, primitive index i refers to spheres[i] if
+    // i < spheres.size() and to instances[i - spheres.size()] otherwise
+    bvh top_level;
+    bool b_accel_dirty = true;
+    // used for meshes and the top level
+    bvh_build_method bvh_method = kBvhBuildSAH;
+    // spheres are kept in top level leaf order, so those of a leaf are
+    // [first_sphere, first_sphere + num_spheres) and are tested in batches
+    struct leaf_spheres {
+        int32_t first_sphere;
+        int32_t num_spheres;
+    };
+    // indexed by top level node
+    std::vector<leaf_spheres> top_level_spheres;
+
+    // 1 for still scenes
+    int num_frames = 1;
+    // sphere index follows spheres when build_accel() renumbers them
+    struct animated_sphere {
+        int32_t sphere;
+        point3 rest_center;
+        object_motion motion;
+    };
+    std::vector<animated_sphere> animated_spheres;
+    // rest pose is given by obj of the mesh
+    struct animated_mesh {
+        int32_t mesh;
+        object_motion motion;
+    };
+    std::vector<animated_mesh> animated_meshes;
 
     public:
 
-    bool load(const char* filename);
+    bool load(const char* filename, const load_options& opts);
 
     scene():background_colour(-1,-1,-1) {}
-    ~scene();
 
     const std::vector<light> &get_lights() const { return lights; }
 
+    // (re)builds top level hierarchy if objects were added since last build
+    void build_accel();
+
+    int get_num_frames() const { return num_frames; }
+    // Moves animated objects to their pose at the given frame. Hierarchies
+    // of moved meshes and the top level are refitted, only those which got
+    // too slow to trace are rebuilt.
+    void set_frame(int frame, frame_stats* stats);
+    // bounds of all objects, empty while top level hierarchy is out of date
+    aabb get_bounds() const {
+        return b_accel_dirty || top_level.empty() ? aabb() : top_level.get_bounds();
+    }
+
+    // Closest t and object are found first, hit attributes are then computed
+    // only for the winner
     bool intersect(const ray &r, Real t_min, Real t_max, hit_info& hit) const {
-        bool b_hit = false;
-        for(const auto& s: spheres) {
-            if(s.hit(r, t_min, t_max, hit)) {
-                t_max = hit.t;
-                hit.mat = s.get_material();
+        if(b_accel_dirty)
+            return intersect_linear(r, t_min, t_max, hit);
+
+        const vec3 orig = r.origin();
+        const vec3 dir = r.direction();
+        const int num_spheres = spheres.size();
+        const mapped_array<bvh_node>& nodes = top_level.get_nodes();
+        const mapped_array<int32_t>& objs = top_level.get_prim_indices();
+        int32_t best_obj = -1;
+        int32_t best_prim = -1;
+        Real best_t = t_max;
+        top_level.intersect_leaves(r, t_min, t_max, [&](int32_t node_idx, Real& t_closest) {
+            bool b_hit = false;
+            const leaf_spheres& ls = top_level_spheres[node_idx];
+            const int32_t s = spheres_intersect(spheres, ls.first_sphere, ls.num_spheres, orig, dir, t_min, &t_closest);
+            if(s >= 0) {
+                best_t = t_closest;
+                best_obj = s;
+                best_prim = -1;
                 b_hit = true;
             }
-        }
 
-        for(const auto& m: meshes) {
-            if(m->hit(r, t_min, t_max, hit)) {
-                t_max = hit.t;
-                hit.mat = m->get_material();
-                b_hit = true;
+            const bvh_node& n = nodes[node_idx];
+            for(int32_t i = n.first; i < n.first + n.count; ++i) {
+                const int32_t obj = objs[i];
+                Real t;
+                int32_t tri;
+                if(obj >= num_spheres && instances[obj - num_spheres].intersect(r, t_min, t_closest, &t, &tri)) {
+                    t_closest = best_t = t;
+                    best_obj = obj;
+                    best_prim = tri;
+                    b_hit = true;
+                }
+            }
+            return b_hit;
+        });
+
+        if(best_obj < 0)
+            return false;
+        finalize_hit(r, best_obj, best_prim, best_t, hit);
+        return true;
+    }
+
+    // Closest hits for all rays of a packet, hits[i] is only filled when
+    // b_hits[i] is true. Hit attributes are computed once traversal is done.
+    void intersect_packet(ray_packet& p, Real t_min, Real t_max, hit_info* hits, bool* b_hits) const;
+
+    // true if anything blocks the ray in the given interval, returns on the
+    // first hit found without computing any hit attributes
+    bool occluded(const ray &r, Real t_min, Real t_max) const {
+        if(b_accel_dirty)
+            return occluded_linear(r, t_min, t_max);
+
+        const vec3 orig = r.origin();
+        const vec3 dir = r.direction();
+        const int num_spheres = spheres.size();
+        const mapped_array<bvh_node>& nodes = top_level.get_nodes();
+        const mapped_array<int32_t>& objs = top_level.get_prim_indices();
+        return top_level.occluded_leaves(r, t_min, t_max, [&](int32_t node_idx) {
+            const leaf_spheres& ls = top_level_spheres[node_idx];
+            if(spheres_occluded(spheres, ls.first_sphere, ls.num_spheres, orig, dir, t_min, t_max))
+                return true;
+
+            const bvh_node& n = nodes[node_idx];
+            for(int32_t i = n.first; i < n.first + n.count; ++i) {
+                const int32_t obj = objs[i];
+                if(obj >= num_spheres && instances[obj - num_spheres].occluded(r, t_min, t_max))
+                    return true;
             }
-        }
+            return false;
+        });
+    }
 
-        return b_hit;
+    int32_t add_material(const material& mat) {
+        materials.push_back(mat);
+        return (int32_t)materials.size() - 1;
     }
 
+    const material& get_material(int32_t mat_id) const { return materials[mat_id]; }
+
     void add_sphere(const point3& pos, Real radius, const material& mat) {
-        spheres.emplace_back(pos, radius, mat);
+        spheres.push_back(sphere(pos, radius, add_material(mat)));
+        b_accel_dirty = true;
     }
 
-    void add_mesh(const struct ObjFile* obj, const material& mat) {
-        meshes.emplace_back(new mesh(obj, mat));
+    void add_mesh(std::shared_ptr<const struct ObjFile> obj, const material& mat) {
+        meshes.push_back(std::make_shared<mesh>(std::move(obj)));
+        instances.emplace_back(meshes.back().get(), add_material(mat), mat4::identity());
+        b_accel_dirty = true;
     }
 
     void add_light(const light& l) {
@@ -85,11 +222,81 @@ class scene {
     const std::string get_output_filename() const { return output_filename; }
 
     private:
+      // hit attributes of primitive prim of object obj (index into spheres
+      // followed by instances, like in top level hierarchy)
+      void finalize_hit(const ray &r, int32_t obj, int32_t prim, Real t, hit_info& hit) const {
+          const int num_spheres = spheres.size();
+          if(obj < num_spheres)
+              spheres.get(obj).finalize_hit(r, t, hit);
+          else
+              instances[obj - num_spheres].finalize_hit(r, t, prim, hit);
+      }
+
+      // brute force fallback used while top level hierarchy is out of date
+      bool intersect_linear(const ray &r, Real t_min, Real t_max, hit_info& hit) const {
+          int32_t best_obj = spheres_intersect(spheres, 0, spheres.size(), r.origin(), r.direction(), t_min, &t_max);
+          int32_t best_prim = -1;
+
+          for(size_t i=0; i<instances.size(); ++i) {
+              Real t;
+              int32_t tri;
+              if(instances[i].intersect(r, t_min, t_max, &t, &tri)) {
+                  t_max = t;
+                  best_obj = (int32_t)(spheres.size() + i);
+                  best_prim = tri;
+              }
+          }
+
+          if(best_obj < 0)
+              return false;
+          finalize_hit(r, best_obj, best_prim, t_max, hit);
+          return true;
+      }
+
+      bool occluded_linear(const ray &r, Real t_min, Real t_max) const {
+          if(spheres_occluded(spheres, 0, spheres.size(), r.origin(), r.direction(), t_min, t_max))
+              return true;
+          for(const mesh_instance& inst: instances) {
+              if(inst.occluded(r, t_min, t_max))
+                  return true;
+          }
+          return false;
+      }
+
       bool read_camera(const class tinyxml2::XMLElement *el,
                        scene::camera_params *cp);
       bool read_lights(const class tinyxml2::XMLElement *el, color* ambient, std::vector<light>* lights);
-      bool read_spheres(const class tinyxml2::XMLElement *el, std::vector<sphere>* spheres);
-      bool read_meshes(const class tinyxml2::XMLElement *el, std::vector<mesh*>* meshes);
+      bool read_spheres(const class tinyxml2::XMLElement *el, sphere_soa* spheres);
+      // reads <animate> element, pivot defaults to the given point
+      bool read_motion(const class tinyxml2::XMLElement *el, const point3& default_pivot,
+                       object_motion* motion);
+      // mesh this scene loaded itself rather than took from the asset cache,
+      // it is shared and written to mesh cache once its hierarchy is built
+      struct loaded_mesh {
+          std::shared_ptr<mesh> m;
+          std::string obj_filename;
+          std::string asset_key;
+          // parsed from obj rather than read from mesh cache
+          bool b_uncached;
+      };
+      // elements with the same obj file share one mesh unless they are
+      // animated, every element adds an instance
+      bool read_meshes(const class tinyxml2::XMLElement *el, std::vector<std::shared_ptr<mesh>>* meshes,
+                       std::vector<loaded_mesh>* loaded);
+      // mesh without hierarchy unless it is read from mesh cache, null on
+      // failure
+      std::shared_ptr<mesh> load_mesh(const std::string& obj_filename, const std::string& asset_key,
+                                      bool* b_uncached);
+      // used through the asset cache when nobody holds the file yet, null on
+      // failure
+      std::shared_ptr<const struct ObjFile> load_obj(const std::string& obj_filename);
+      class asset_cache& get_asset_cache() const;
+      // <transform> element, its children are applied in document order
+      bool read_transform(const class tinyxml2::XMLElement *el, mat4* m);
+      // builds hierarchies of all meshes without one at once and prints stats
+      void build_mesh_accels();
+      // top level primitive bounds, spheres in their current order
+      void get_object_bounds(std::vector<aabb>* bounds) const;
       bool read_material_solid(const class tinyxml2::XMLElement *el, material* mat);
 
       color read_colour(const class tinyxml2::XMLElement *el, bool *b_success);
@@ -0,0 +1,61 @@
+#include "simd_dispatch.h"
+#include "tri_block.h"
+#include "sphere_soa.h"
+
+#include <string.h>
+
+static simd_isa selected_isa = kSimdScalar;
+
+simd_isa detect_simd_isa() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // also checks that the OS saves AVX registers
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return kSimdAVX2;
+    if(__builtin_cpu_supports("sse4.2"))
+        return kSimdSSE42;
+#endif
+    return kSimdScalar;
+}
+
+const char* simd_isa_name(simd_isa isa) {
+    switch(isa) {
+        case kSimdScalar: return "scalar";
+        case kSimdSSE42: return "sse42";
+        case kSimdAVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+bool parse_simd_isa(const char* name, simd_isa* isa) {
+    const simd_isa all[] = { kSimdScalar, kSimdSSE42, kSimdAVX2 };
+    for(simd_isa i: all) {
+        if(!strcmp(name, simd_isa_name(i))) {
+            *isa = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void select_simd_isa(simd_isa isa) {
+    switch(isa) {
+        case kSimdScalar:
+            tri_block_intersect_impl = tri_block_intersect_scalar;
+            spheres_intersect_impl = spheres_intersect_scalar;
+            break;
+        case kSimdSSE42:
+            tri_block_intersect_impl = tri_block_intersect_sse42;
+            spheres_intersect_impl = spheres_intersect_sse42;
+            break;
+        case kSimdAVX2:
+            tri_block_intersect_impl = tri_block_intersect_avx2;
+            spheres_intersect_impl = spheres_intersect_avx2;
+            break;
+    }
+    selected_isa = isa;
+}
+
+simd_isa get_simd_isa() {
+    return selected_isa;
+}
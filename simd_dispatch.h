@@ -0,0 +1,26 @@
+#pragma once
+
+// Instruction set variants of the triangle and sphere kernels. All of them
+// are built into the binary and the best one the CPU supports is picked at
+// startup, so one build runs on every x86-64 machine.
+enum simd_isa { kSimdScalar, kSimdSSE42, kSimdAVX2 };
+
+// best variant supported by the running CPU, checked with CPUID
+simd_isa detect_simd_isa();
+const char* simd_isa_name(simd_isa isa);
+// accepts names returned by simd_isa_name()
+bool parse_simd_isa(const char* name, simd_isa* isa);
+
+// Switches kernels to the given variant which must be supported by the CPU.
+// Not thread safe, to be called before any rays are traced.
+void select_simd_isa(simd_isa isa);
+simd_isa get_simd_isa();
+
+// Compiles a kernel for the given instruction set without changing build
+// flags of its file, so inline functions from headers instantiated there
+// stay runnable on any CPU.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMD_TARGET(isa)
+#endif
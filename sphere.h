@@ -1,24 +1,42 @@
 #pragma once
 
 #include "config.h"
+#include "aabb.h"
 #include "hit.h"
 #include "ray.h"
 #include "vec.h"
 
+#include <cmath>
+#include <limits>
+
 class sphere {
   public:
     sphere() {}
-    sphere(point3 cen, Real r, const material& m) : center(cen), radius(r), mat(m){};
+    sphere(point3 cen, Real r, int32_t m) : center(cen), radius(r), mat_id(m){};
 
-    material get_material() const { return mat; }
+    int32_t get_material_id() const { return mat_id; }
+    // padded by the rounding error of intersect(), so every hit it reports
+    // lies inside and hierarchies of any builder find the same hits
+    aabb get_bounds() const {
+        const Real eps = std::numeric_limits<Real>::epsilon();
+        const Real max_coord = max(std::abs(center.x), max(std::abs(center.y), std::abs(center.z)));
+        const Real pad = radius * (1 + 4 * eps) + eps * max_coord;
+        const vec3 r(pad, pad, pad);
+        return aabb(center - r, center + r);
+    }
 
-    bool hit(const ray &r, Real t_min, Real t_max, hit_info &rec) const {
+    // closest root in [t_min, t_max] without any hit attributes
+    bool intersect(const ray &r, Real t_min, Real t_max, Real* t) const {
         vec3 oc = r.origin() - center;
         auto a = lengthSqr(r.direction());
         auto half_b = dot(oc, r.direction());
-        auto c = lengthSqr(oc) - radius * radius;
 
-        auto discriminant = half_b * half_b - a * c;
+        // a * (radius^2 - squared distance of the ray from the centre), the
+        // same as half_b^2 - a * c without its cancellation, which lets
+        // grazing rays far from the sphere hit well outside of it. Reciprocal
+        // of a is kept per ray by the SIMD kernels, rounding matches them.
+        vec3 f = oc - (half_b * (Real(1) / a)) * r.direction();
+        auto discriminant = a * (radius * radius - lengthSqr(f));
         if (discriminant < 0)
             return false;
         auto sqrtd = std::sqrt(discriminant);
@@ -31,15 +49,33 @@ class sphere {
                 return false;
         }
 
-        rec.t = root;
+        *t = root;
+        return true;
+    }
+
+    // fills hit attributes once t is known to be the closest hit
+    void finalize_hit(const ray &r, Real t, hit_info &rec) const {
+        rec.t = t;
         rec.p = r.at(rec.t);
         rec.normal = (rec.p - center) / radius;
+        rec.mat_id = mat_id;
+    }
 
+    bool hit(const ray &r, Real t_min, Real t_max, hit_info &rec) const {
+        Real t;
+        if (!intersect(r, t_min, t_max, &t))
+            return false;
+        finalize_hit(r, t, rec);
         return true;
     }
 
+    bool occluded(const ray &r, Real t_min, Real t_max) const {
+        Real t;
+        return intersect(r, t_min, t_max, &t);
+    }
+
   public:
     point3 center;
     Real radius;
-    material mat;
+    int32_t mat_id;
 };
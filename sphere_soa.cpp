@@ -0,0 +1,104 @@
+#include "sphere_soa.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void sphere_soa::clear() {
+    center_x.clear();
+    center_y.clear();
+    center_z.clear();
+    radius.clear();
+    mat_id.clear();
+}
+
+void sphere_soa::push_back(const sphere& s) {
+    center_x.push_back(s.center.x);
+    center_y.push_back(s.center.y);
+    center_z.push_back(s.center.z);
+    radius.push_back(s.radius);
+    mat_id.push_back(s.mat_id);
+}
+
+void sphere_soa::permute(const std::vector<int32_t>& order) {
+    sphere_soa tmp;
+    for(int32_t i: order) {
+        tmp.push_back(get(i));
+    }
+    *this = std::move(tmp);
+}
+
+int spheres_intersect_scalar(const sphere_soa& s, int first, int count, const vec3& orig,
+                             const vec3& dir, Real t_min, Real* t_max) {
+    const ray r(orig, dir);
+    int best = -1;
+    for(int i = first; i < first + count; ++i) {
+        if(s.get(i).intersect(r, t_min, *t_max, t_max))
+            best = i;
+    }
+    return best;
+}
+
+spheres_intersect_fn spheres_intersect_impl = spheres_intersect_scalar;
+
+void spheres_intersect_packet(const sphere_soa& s, int first, int count, ray_packet& p,
+                              int first_ray, int end_ray, Real t_min) {
+#if defined(__SSE2__)
+    const __m128 tmin = _mm_set1_ps(t_min);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    for(int i = first; i < first + count; ++i) {
+        const __m128 cx = _mm_set1_ps(s.center_x[i]), cy = _mm_set1_ps(s.center_y[i]), cz = _mm_set1_ps(s.center_z[i]);
+        const __m128 r2 = _mm_set1_ps(s.radius[i] * s.radius[i]);
+        for(int k = first_ray & ~3; k < end_ray; k += 4) {
+            const __m128 dx = _mm_load_ps(p.dx + k), dy = _mm_load_ps(p.dy + k), dz = _mm_load_ps(p.dz + k);
+            const __m128 ocx = _mm_sub_ps(_mm_load_ps(p.ox + k), cx);
+            const __m128 ocy = _mm_sub_ps(_mm_load_ps(p.oy + k), cy);
+            const __m128 ocz = _mm_sub_ps(_mm_load_ps(p.oz + k), cz);
+
+            const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            const __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+            // a * (r^2 - squared distance of the ray from the centre) as in sphere::intersect()
+            const __m128 tc = _mm_mul_ps(half_b, _mm_div_ps(_mm_set1_ps(1.0f), a));
+            const __m128 fx = _mm_sub_ps(ocx, _mm_mul_ps(tc, dx));
+            const __m128 fy = _mm_sub_ps(ocy, _mm_mul_ps(tc, dy));
+            const __m128 fz = _mm_sub_ps(ocz, _mm_mul_ps(tc, dz));
+            const __m128 f2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz));
+            const __m128 discriminant = _mm_mul_ps(a, _mm_sub_ps(r2, f2));
+            const __m128 has_roots = _mm_cmpge_ps(discriminant, _mm_setzero_ps());
+            if(!_mm_movemask_ps(has_roots))
+                continue;
+
+            const __m128 sqrtd = _mm_sqrt_ps(discriminant);
+            const __m128 neg_half_b = _mm_xor_ps(half_b, sign);
+            const __m128 tmax = _mm_load_ps(p.t_max + k);
+            const __m128 root0 = _mm_div_ps(_mm_sub_ps(neg_half_b, sqrtd), a);
+            const __m128 root1 = _mm_div_ps(_mm_add_ps(neg_half_b, sqrtd), a);
+            const __m128 ok0 = _mm_and_ps(_mm_cmpge_ps(root0, tmin), _mm_cmple_ps(root0, tmax));
+            const __m128 ok1 = _mm_and_ps(_mm_cmpge_ps(root1, tmin), _mm_cmple_ps(root1, tmax));
+            const __m128 root = _mm_or_ps(_mm_and_ps(ok0, root0), _mm_andnot_ps(ok0, root1));
+            const __m128 b_hit = _mm_and_ps(has_roots, _mm_or_ps(ok0, ok1));
+            const int mask = _mm_movemask_ps(b_hit);
+            if(!mask)
+                continue;
+
+            _mm_store_ps(p.t_max + k, _mm_or_ps(_mm_and_ps(b_hit, root), _mm_andnot_ps(b_hit, tmax)));
+            for(int l=0; l<4; ++l) {
+                if(mask & (1 << l)) {
+                    p.obj[k + l] = i;
+                    p.prim[k + l] = -1;
+                }
+            }
+        }
+    }
+#else
+    for(int i = first; i < first + count; ++i) {
+        const sphere sp = s.get(i);
+        for(int k = first_ray; k < end_ray; ++k) {
+            if(sp.intersect(p.get_ray(k), t_min, p.t_max[k], &p.t_max[k])) {
+                p.obj[k] = i;
+                p.prim[k] = -1;
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+#include "sphere.h"
+#include "ray_packet.h"
+
+#include <vector>
+#include <stdint.h>
+#include <float.h>
+
+static const int kSphereBatchWidth = 8;
+
+// Sphere geometry as structure of arrays, so consecutive spheres are tested
+// kSphereBatchWidth at a time without striding over anything but the 16
+// bytes of geometry. Materials are referenced by id from a separate array.
+struct sphere_soa {
+    std::vector<float> center_x, center_y, center_z, radius;
+    std::vector<int32_t> mat_id;
+
+    int size() const { return (int)radius.size(); }
+    bool empty() const { return radius.empty(); }
+    void clear();
+    void push_back(const sphere& s);
+    sphere get(int i) const {
+        return sphere(point3(center_x[i], center_y[i], center_z[i]), radius[i], mat_id[i]);
+    }
+    void set_center(int i, const point3& c) {
+        center_x[i] = c.x;
+        center_y[i] = c.y;
+        center_z[i] = c.z;
+    }
+    // new i-th sphere is the old order[i]-th one
+    void permute(const std::vector<int32_t>& order);
+};
+
+// All variants return index of the closest of spheres [first, first + count)
+// with a root in [t_min, *t_max] and shrink *t_max to it, or -1 if none is
+// hit. As with sphere::hit() called in sequence, the later sphere wins ties.
+// Same operations in the same order, so results are bit identical.
+int spheres_intersect_scalar(const sphere_soa& s, int first, int count, const vec3& orig,
+                             const vec3& dir, Real t_min, Real* t_max);
+int spheres_intersect_sse42(const sphere_soa& s, int first, int count, const vec3& orig,
+                            const vec3& dir, Real t_min, Real* t_max);
+int spheres_intersect_avx2(const sphere_soa& s, int first, int count, const vec3& orig,
+                           const vec3& dir, Real t_min, Real* t_max);
+
+using spheres_intersect_fn = int (*)(const sphere_soa& s, int first, int count, const vec3& orig,
+                                     const vec3& dir, Real t_min, Real* t_max);
+// variant chosen at startup by select_simd_isa(), scalar until then
+extern spheres_intersect_fn spheres_intersect_impl;
+
+INLINE int spheres_intersect(const sphere_soa& s, int first, int count, const vec3& orig,
+                             const vec3& dir, Real t_min, Real* t_max) {
+    return spheres_intersect_impl(s, first, count, orig, dir, t_min, t_max);
+}
+
+INLINE bool spheres_occluded(const sphere_soa& s, int first, int count, const vec3& orig,
+                             const vec3& dir, Real t_min, Real t_max) {
+    return spheres_intersect(s, first, count, orig, dir, t_min, &t_max) >= 0;
+}
+
+// Closest hits of spheres [first, first + count) for rays [first_ray, end_ray)
+// of a packet, records sphere index as the hit object of rays for which a
+// sphere is closer than their t_max
+void spheres_intersect_packet(const sphere_soa& s, int first, int count, ray_packet& p,
+                              int first_ray, int end_ray, Real t_min);
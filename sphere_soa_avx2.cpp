@@ -0,0 +1,89 @@
+#include "sphere_soa.h"
+#include "simd_dispatch.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+
+#include <immintrin.h>
+
+// loads n < 8 trailing floats, the rest of lanes is masked out by the caller
+SIMD_TARGET("avx2")
+static INLINE __m256 load_tail(const float* p, int n) {
+    float tmp[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    for(int i=0; i<n; ++i) tmp[i] = p[i];
+    return _mm256_loadu_ps(tmp);
+}
+
+// AVX2 variant (no FMA, so rounding matches the scalar code), 8 spheres per
+// iteration.
+SIMD_TARGET("avx2")
+int spheres_intersect_avx2(const sphere_soa& s, int first, int count, const vec3& orig,
+                           const vec3& dir, Real t_min, Real* t_max) {
+
+    const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+    const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+    const __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    const __m256 oo_a = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+    const __m256 tmin = _mm256_set1_ps(t_min);
+    const __m256 inf = _mm256_set1_ps(FLT_MAX);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    const __m256i lane_idx = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+    int best = -1;
+    const int end = first + count;
+    for(int k = first; k < end; k += kSphereBatchWidth) {
+        const int n = min(kSphereBatchWidth, end - k);
+        __m256 cx, cy, cz, r;
+        if(n == kSphereBatchWidth) {
+            cx = _mm256_loadu_ps(&s.center_x[k]); cy = _mm256_loadu_ps(&s.center_y[k]);
+            cz = _mm256_loadu_ps(&s.center_z[k]); r = _mm256_loadu_ps(&s.radius[k]);
+        } else {
+            cx = load_tail(&s.center_x[k], n); cy = load_tail(&s.center_y[k], n);
+            cz = load_tail(&s.center_z[k], n); r = load_tail(&s.radius[k], n);
+        }
+
+        const __m256 ocx = _mm256_sub_ps(ox, cx), ocy = _mm256_sub_ps(oy, cy), ocz = _mm256_sub_ps(oz, cz);
+        const __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        // a * (r^2 - squared distance of the ray from the centre) as in sphere::intersect()
+        const __m256 tc = _mm256_mul_ps(half_b, oo_a);
+        const __m256 fx = _mm256_sub_ps(ocx, _mm256_mul_ps(tc, dx));
+        const __m256 fy = _mm256_sub_ps(ocy, _mm256_mul_ps(tc, dy));
+        const __m256 fz = _mm256_sub_ps(ocz, _mm256_mul_ps(tc, dz));
+        const __m256 f2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(fx, fx), _mm256_mul_ps(fy, fy)), _mm256_mul_ps(fz, fz));
+        const __m256 discriminant = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_mul_ps(r, r), f2));
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                    _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane_idx)));
+        if(!_mm256_movemask_ps(mask))
+            continue;
+
+        const __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        const __m256 neg_half_b = _mm256_xor_ps(half_b, sign);
+        const __m256 tmax = _mm256_set1_ps(*t_max);
+        const __m256 root0 = _mm256_div_ps(_mm256_sub_ps(neg_half_b, sqrtd), a);
+        const __m256 root1 = _mm256_div_ps(_mm256_add_ps(neg_half_b, sqrtd), a);
+        const __m256 ok0 = _mm256_and_ps(_mm256_cmp_ps(root0, tmin, _CMP_GE_OQ), _mm256_cmp_ps(root0, tmax, _CMP_LE_OQ));
+        const __m256 ok1 = _mm256_and_ps(_mm256_cmp_ps(root1, tmin, _CMP_GE_OQ), _mm256_cmp_ps(root1, tmax, _CMP_LE_OQ));
+        const __m256 root = _mm256_blendv_ps(root1, root0, ok0);
+        mask = _mm256_and_ps(mask, _mm256_or_ps(ok0, ok1));
+        if(!_mm256_movemask_ps(mask))
+            continue;
+
+        // closest of the hit lanes, last one on ties
+        const __m256 tm = _mm256_blendv_ps(inf, root, mask);
+        __m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        const int lanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(tm, m, _CMP_EQ_OQ)));
+        *t_max = _mm256_cvtss_f32(m);
+        best = k + 31 - __builtin_clz(lanes);
+    }
+    return best;
+}
+
+#else
+
+int spheres_intersect_avx2(const sphere_soa& s, int first, int count, const vec3& orig,
+                           const vec3& dir, Real t_min, Real* t_max) {
+    return spheres_intersect_scalar(s, first, count, orig, dir, t_min, t_max);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include "sphere_soa.h"
+#include "simd_dispatch.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+
+#include <nmmintrin.h>
+
+// loads n < 4 trailing floats, the rest of lanes is masked out by the caller
+SIMD_TARGET("sse4.2")
+static INLINE __m128 load_tail(const float* p, int n) {
+    float tmp[4] = { 0, 0, 0, 0 };
+    for(int i=0; i<n; ++i) tmp[i] = p[i];
+    return _mm_loadu_ps(tmp);
+}
+
+// SSE4.2 variant, 4 spheres per iteration.
+SIMD_TARGET("sse4.2")
+int spheres_intersect_sse42(const sphere_soa& s, int first, int count, const vec3& orig,
+                            const vec3& dir, Real t_min, Real* t_max) {
+
+    const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+    const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    const __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+    const __m128 oo_a = _mm_div_ps(_mm_set1_ps(1.0f), a);
+    const __m128 tmin = _mm_set1_ps(t_min);
+    const __m128 inf = _mm_set1_ps(FLT_MAX);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128i lane_idx = _mm_set_epi32(3, 2, 1, 0);
+
+    int best = -1;
+    const int end = first + count;
+    for(int k = first; k < end; k += 4) {
+        const int n = min(4, end - k);
+        __m128 cx, cy, cz, r;
+        if(n == 4) {
+            cx = _mm_loadu_ps(&s.center_x[k]); cy = _mm_loadu_ps(&s.center_y[k]);
+            cz = _mm_loadu_ps(&s.center_z[k]); r = _mm_loadu_ps(&s.radius[k]);
+        } else {
+            cx = load_tail(&s.center_x[k], n); cy = load_tail(&s.center_y[k], n);
+            cz = load_tail(&s.center_z[k], n); r = load_tail(&s.radius[k], n);
+        }
+
+        const __m128 ocx = _mm_sub_ps(ox, cx), ocy = _mm_sub_ps(oy, cy), ocz = _mm_sub_ps(oz, cz);
+        const __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        // a * (r^2 - squared distance of the ray from the centre) as in sphere::intersect()
+        const __m128 tc = _mm_mul_ps(half_b, oo_a);
+        const __m128 fx = _mm_sub_ps(ocx, _mm_mul_ps(tc, dx));
+        const __m128 fy = _mm_sub_ps(ocy, _mm_mul_ps(tc, dy));
+        const __m128 fz = _mm_sub_ps(ocz, _mm_mul_ps(tc, dz));
+        const __m128 f2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(fx, fx), _mm_mul_ps(fy, fy)), _mm_mul_ps(fz, fz));
+        const __m128 discriminant = _mm_mul_ps(a, _mm_sub_ps(_mm_mul_ps(r, r), f2));
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()),
+                                 _mm_castsi128_ps(_mm_cmplt_epi32(lane_idx, _mm_set1_epi32(n))));
+        if(!_mm_movemask_ps(mask))
+            continue;
+
+        const __m128 sqrtd = _mm_sqrt_ps(discriminant);
+        const __m128 neg_half_b = _mm_xor_ps(half_b, sign);
+        const __m128 tmax = _mm_set1_ps(*t_max);
+        const __m128 root0 = _mm_div_ps(_mm_sub_ps(neg_half_b, sqrtd), a);
+        const __m128 root1 = _mm_div_ps(_mm_add_ps(neg_half_b, sqrtd), a);
+        const __m128 ok0 = _mm_and_ps(_mm_cmpge_ps(root0, tmin), _mm_cmple_ps(root0, tmax));
+        const __m128 ok1 = _mm_and_ps(_mm_cmpge_ps(root1, tmin), _mm_cmple_ps(root1, tmax));
+        const __m128 root = _mm_blendv_ps(root1, root0, ok0);
+        mask = _mm_and_ps(mask, _mm_or_ps(ok0, ok1));
+        if(!_mm_movemask_ps(mask))
+            continue;
+
+        // closest of the hit lanes, last one on ties
+        const __m128 tm = _mm_blendv_ps(inf, root, mask);
+        __m128 m = _mm_min_ps(tm, _mm_shuffle_ps(tm, tm, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        const int lanes = _mm_movemask_ps(_mm_and_ps(mask, _mm_cmpeq_ps(tm, m)));
+        *t_max = _mm_cvtss_f32(m);
+        best = k + 31 - __builtin_clz(lanes);
+    }
+    return best;
+}
+
+#else
+
+int spheres_intersect_sse42(const sphere_soa& s, int first, int count, const vec3& orig,
+                            const vec3& dir, Real t_min, Real* t_max) {
+    return spheres_intersect_scalar(s, first, count, orig, dir, t_min, t_max);
+}
+
+#endif
@@ -0,0 +1,80 @@
+# Renders a cloud of small spheres with hierarchies from every builder and
+# requires identical images, grazing hits must not depend on how primitives
+# are grouped into leaves.
+#   cmake -DRAYTRACER=<exe> -DWORK_DIR=<dir> -P bvh_builders_match.cmake
+
+if(NOT RAYTRACER OR NOT WORK_DIR)
+    message(FATAL_ERROR "RAYTRACER and WORK_DIR have to be set")
+endif()
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+set(num_spheres 20000)
+set(material "<material_solid><color r=\"0.8\" g=\"0.2\" b=\"0.2\"/><phong ka=\"1\" kd=\"0.8\" ks=\"0.5\" exponent=\"32\"/><reflectance r=\"0.2\"/><transmittance t=\"0\"/><refraction iof=\"1\"/></material_solid>")
+
+# same sequence on every platform, returns integer in [0, range)
+set(seed 12345)
+macro(next_random range out)
+    math(EXPR seed "(${seed} * 1103515245 + 12345) % 2147483648")
+    math(EXPR ${out} "(${seed} >> 8) % ${range}")
+endmacro()
+
+# integer in millionths as decimal number
+function(format_micro value out)
+    set(sign "")
+    if(value LESS 0)
+        set(sign "-")
+        math(EXPR value "-(${value})")
+    endif()
+    math(EXPR whole "${value} / 1000000")
+    math(EXPR frac "${value} % 1000000 + 1000000")
+    string(SUBSTRING "${frac}" 1 6 frac)
+    set(${out} "${sign}${whole}.${frac}" PARENT_SCOPE)
+endfunction()
+
+set(scene_file "${WORK_DIR}/cloud.xml")
+file(WRITE "${scene_file}" "<?xml version=\"1.0\" standalone=\"no\" ?>
+<scene output_file=\"cloud.ppm\">
+<background_color r=\"0.1\" g=\"0.1\" b=\"0.2\"/>
+<camera><position x=\"0\" y=\"0\" z=\"1\"/><lookat x=\"0\" y=\"0\" z=\"-2.5\"/><up x=\"0\" y=\"1\" z=\"0\"/><horizontal_fov angle=\"45\"/><resolution horizontal=\"320\" vertical=\"240\"/><max_bounces n=\"8\"/></camera>
+<lights><ambient_light><color r=\"0.1\" g=\"0.1\" b=\"0.1\"/></ambient_light><parallel_light><color r=\"0.5\" g=\"0.5\" b=\"0.5\"/><direction x=\"-0.3\" y=\"-1\" z=\"-0.5\"/></parallel_light></lights>
+<surfaces>
+")
+
+# written in chunks, appending to one long string gets slow
+set(spheres "")
+foreach(i RANGE 1 ${num_spheres})
+    next_random(3000000 x)
+    next_random(2400000 y)
+    next_random(2000000 z)
+    next_random(2000 r)
+    math(EXPR x "${x} - 1500000")
+    math(EXPR y "${y} - 1200000")
+    math(EXPR z "${z} - 4000000")
+    math(EXPR r "${r} + 1000")
+    format_micro(${x} x)
+    format_micro(${y} y)
+    format_micro(${z} z)
+    format_micro(${r} r)
+    string(APPEND spheres "<sphere radius=\"${r}\"><position x=\"${x}\" y=\"${y}\" z=\"${z}\"/>${material}</sphere>\n")
+    math(EXPR chunk_end "${i} % 500")
+    if(chunk_end EQUAL 0)
+        file(APPEND "${scene_file}" "${spheres}")
+        set(spheres "")
+    endif()
+endforeach()
+file(APPEND "${scene_file}" "${spheres}</surfaces>\n</scene>\n")
+
+foreach(builder sah lbvh)
+    execute_process(COMMAND "${RAYTRACER}" --bvh-builder ${builder} cloud.xml
+                    WORKING_DIRECTORY "${WORK_DIR}" RESULT_VARIABLE result OUTPUT_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Rendering with ${builder} hierarchies failed: ${result}")
+    endif()
+    file(RENAME "${WORK_DIR}/cloud.ppm" "${WORK_DIR}/cloud_${builder}.ppm")
+endforeach()
+
+execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files cloud_sah.ppm cloud_lbvh.ppm
+                WORKING_DIRECTORY "${WORK_DIR}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Images rendered with sah and lbvh hierarchies differ")
+endif()
@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(int num_threads):num_pending(0) {
+
+    if(num_threads < 1)
+        num_threads = 1;
+
+    for(int i=0; i<num_threads; ++i) {
+        queues.emplace_back(new task_queue);
+    }
+    for(int i=0; i<num_threads; ++i) {
+        threads.emplace_back(&thread_pool::worker_main, this, i);
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        b_quit = true;
+    }
+    cv_work.notify_all();
+    for(auto& t: threads) {
+        t.join();
+    }
+}
+
+int thread_pool::default_num_threads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? (int)n : 1;
+}
+
+void thread_pool::parallel_for(int num_tasks, const task_fn& fn) {
+
+    if(num_tasks <= 0)
+        return;
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    // give each worker a contiguous range so neighbouring tasks stay on the
+    // same thread unless they get stolen
+    const int num_threads = get_num_threads();
+    for(int t=0; t<num_threads; ++t) {
+        const int first = (int)((int64_t)num_tasks * t / num_threads);
+        const int last = (int)((int64_t)num_tasks * (t + 1) / num_threads);
+        std::lock_guard<std::mutex> queue_guard(queues[t]->lock);
+        for(int i = first; i < last; ++i) {
+            queues[t]->tasks.push_back(i);
+        }
+    }
+
+    num_pending = num_tasks;
+    job = &fn;
+    ++job_id;
+    cv_work.notify_all();
+    // workers which are still draining queues could otherwise pick up tasks
+    // of the next job with this job's function
+    cv_done.wait(guard, [this]() { return num_pending == 0 && num_active == 0; });
+    job = nullptr;
+}
+
+bool thread_pool::pop_task(int thread_idx, int* task_idx) {
+
+    {
+        task_queue& own = *queues[thread_idx];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if(!own.tasks.empty()) {
+            *task_idx = own.tasks.front();
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+
+    const int num_threads = get_num_threads();
+    for(int i=1; i<num_threads; ++i) {
+        task_queue& victim = *queues[(thread_idx + i) % num_threads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if(!victim.tasks.empty()) {
+            *task_idx = victim.tasks.back();
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void thread_pool::worker_main(int thread_idx) {
+
+    uint64_t last_job_id = 0;
+    while(true) {
+        const task_fn* fn;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cv_work.wait(guard, [&]() { return b_quit || job_id != last_job_id; });
+            if(b_quit)
+                return;
+            last_job_id = job_id;
+            fn = job;
+            // woke up after the job was already finished
+            if(!fn)
+                continue;
+            ++num_active;
+        }
+
+        int task_idx;
+        while(pop_task(thread_idx, &task_idx)) {
+            (*fn)(task_idx, thread_idx);
+            --num_pending;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            --num_active;
+        }
+        cv_done.notify_all();
+    }
+}
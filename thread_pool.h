@@ -0,0 +1,55 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+
+// Persistent pool of worker threads. Each worker owns a task queue, takes
+// work from its front and steals from the back of other queues when it runs
+// dry, so uneven tasks (e.g. image tiles) get balanced automatically.
+class thread_pool {
+  public:
+    using task_fn = std::function<void(int task_idx, int thread_idx)>;
+
+    explicit thread_pool(int num_threads);
+    ~thread_pool();
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int get_num_threads() const { return (int)threads.size(); }
+
+    // Runs fn for every task in [0, num_tasks) and blocks until all are done.
+    // Must not be called from inside a task.
+    void parallel_for(int num_tasks, const task_fn& fn);
+
+    static int default_num_threads();
+
+  private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+
+    void worker_main(int thread_idx);
+    bool pop_task(int thread_idx, int* task_idx);
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<task_queue>> queues;
+
+    std::mutex lock;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    const task_fn* job = nullptr;
+    uint64_t job_id = 0;
+    std::atomic<int> num_pending;
+    // workers currently draining queues, guarded by lock
+    int num_active = 0;
+    bool b_quit = false;
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+#include "aabb.h"
+
+#include <cmath>
+
+// Row major 4x4 matrix applied to column vectors, p' = M * p. Only affine
+// transforms are used, the last row is always (0, 0, 0, 1).
+struct mat4 {
+    Real m[4][4];
+
+    static mat4 identity() {
+        mat4 r;
+        for(int i=0; i<4; ++i) {
+            for(int j=0; j<4; ++j) {
+                r.m[i][j] = i == j ? Real(1) : Real(0);
+            }
+        }
+        return r;
+    }
+
+    static mat4 translation(const vec3& t) {
+        mat4 r = identity();
+        r.m[0][3] = t.x;
+        r.m[1][3] = t.y;
+        r.m[2][3] = t.z;
+        return r;
+    }
+
+    static mat4 scale(const vec3& s) {
+        mat4 r = identity();
+        r.m[0][0] = s.x;
+        r.m[1][1] = s.y;
+        r.m[2][2] = s.z;
+        return r;
+    }
+
+    // counter clockwise around a unit axis
+    static mat4 rotation(const vec3& unit_axis, Real degrees) {
+        const Real rad = degrees_to_radians(degrees);
+        const Real c = cos(rad);
+        const Real s = sin(rad);
+        const Real k = 1 - c;
+        const Real x = unit_axis.x, y = unit_axis.y, z = unit_axis.z;
+        mat4 r = identity();
+        r.m[0][0] = c + k*x*x;   r.m[0][1] = k*x*y - s*z; r.m[0][2] = k*x*z + s*y;
+        r.m[1][0] = k*y*x + s*z; r.m[1][1] = c + k*y*y;   r.m[1][2] = k*y*z - s*x;
+        r.m[2][0] = k*z*x - s*y; r.m[2][1] = k*z*y + s*x; r.m[2][2] = c + k*z*z;
+        return r;
+    }
+
+    bool is_identity() const {
+        for(int i=0; i<4; ++i) {
+            for(int j=0; j<4; ++j) {
+                if(m[i][j] != (i == j ? Real(1) : Real(0)))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool is_affine() const {
+        return m[3][0] == 0 && m[3][1] == 0 && m[3][2] == 0 && m[3][3] == 1;
+    }
+
+    vec3 transform_point(const vec3& p) const {
+        return vec3(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+                    m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+                    m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+    }
+
+    vec3 transform_vector(const vec3& v) const {
+        return vec3(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                    m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                    m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+    }
+
+    // by the transposed upper 3x3, normals are transformed this way with
+    // the inverse matrix
+    vec3 transform_vector_transposed(const vec3& v) const {
+        return vec3(m[0][0]*v.x + m[1][0]*v.y + m[2][0]*v.z,
+                    m[0][1]*v.x + m[1][1]*v.y + m[2][1]*v.z,
+                    m[0][2]*v.x + m[1][2]*v.y + m[2][2]*v.z);
+    }
+};
+
+INLINE mat4 operator*(const mat4& a, const mat4& b) {
+    mat4 r;
+    for(int i=0; i<4; ++i) {
+        for(int j=0; j<4; ++j) {
+            r.m[i][j] = a.m[i][0]*b.m[0][j] + a.m[i][1]*b.m[1][j] + a.m[i][2]*b.m[2][j] + a.m[i][3]*b.m[3][j];
+        }
+    }
+    return r;
+}
+
+// inverse of an affine matrix, false if it is singular
+INLINE bool affine_inverse(const mat4& a, mat4* inv) {
+    const Real (*m)[4] = a.m;
+    // cofactors of the upper 3x3
+    const Real c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+    const Real c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+    const Real c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+    const Real det = m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02;
+    if(det == Real(0) || !a.is_affine())
+        return false;
+    const Real oo_det = Real(1) / det;
+
+    mat4 r = mat4::identity();
+    r.m[0][0] = c00 * oo_det;
+    r.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * oo_det;
+    r.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * oo_det;
+    r.m[1][0] = c01 * oo_det;
+    r.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * oo_det;
+    r.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * oo_det;
+    r.m[2][0] = c02 * oo_det;
+    r.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * oo_det;
+    r.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * oo_det;
+
+    const vec3 t = r.transform_vector(vec3(m[0][3], m[1][3], m[2][3]));
+    r.m[0][3] = -t.x;
+    r.m[1][3] = -t.y;
+    r.m[2][3] = -t.z;
+    *inv = r;
+    return true;
+}
+
+// box around the transformed box, every output axis takes the smaller and
+// the larger contribution of each input axis
+INLINE aabb transform_bounds(const mat4& a, const aabb& b) {
+    if(b.is_empty())
+        return b;
+    const Real bmin[3] = { b.pmin.x, b.pmin.y, b.pmin.z };
+    const Real bmax[3] = { b.pmax.x, b.pmax.y, b.pmax.z };
+    Real rmin[3], rmax[3];
+    for(int i=0; i<3; ++i) {
+        rmin[i] = rmax[i] = a.m[i][3];
+        for(int j=0; j<3; ++j) {
+            const Real lo = a.m[i][j] * bmin[j];
+            const Real hi = a.m[i][j] * bmax[j];
+            rmin[i] += min(lo, hi);
+            rmax[i] += max(lo, hi);
+        }
+    }
+    return aabb(vec3(rmin[0], rmin[1], rmin[2]), vec3(rmax[0], rmax[1], rmax[2]));
+}
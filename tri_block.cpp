@@ -0,0 +1,22 @@
+#include "tri_block.h"
+#include "mesh.h"
+
+int tri_block_intersect_scalar(const tri_block& b, const vec3& orig, const vec3& dir,
+                               Real t_min, Real* t_max) {
+    int best = -1;
+    for(int i=0; i<kTriBlockWidth; ++i) {
+        mesh_triangle tri;
+        tri.v0 = vec3(b.v0x[i], b.v0y[i], b.v0z[i]);
+        tri.e1 = vec3(b.e1x[i], b.e1y[i], b.e1z[i]);
+        tri.e2 = vec3(b.e2x[i], b.e2y[i], b.e2z[i]);
+
+        Real t, u, v;
+        if(ray_tri_intersect(orig, dir, tri, t_min, *t_max, &t, &u, &v)) {
+            *t_max = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+tri_block_intersect_fn tri_block_intersect_impl = tri_block_intersect_scalar;
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "config.h"
+#include "vec.h"
+
+#include <stdint.h>
+#include <float.h>
+
+static const int kTriBlockWidth = 8;
+
+// Structure of arrays layout of up to 8 triangles prepared for Moller-Trumbore
+// test, so one ray can be tested against all of them with SIMD. Unused lanes
+// have zero edges (never hit) and tri_id -1.
+struct tri_block {
+    float v0x[kTriBlockWidth], v0y[kTriBlockWidth], v0z[kTriBlockWidth];
+    float e1x[kTriBlockWidth], e1y[kTriBlockWidth], e1z[kTriBlockWidth];
+    float e2x[kTriBlockWidth], e2y[kTriBlockWidth], e2z[kTriBlockWidth];
+    int32_t tri_id[kTriBlockWidth];
+};
+
+// All variants return the lane of the closest hit in (t_min, *t_max) and
+// shrink *t_max to it, or -1 if there is no hit. Ties go to the lower lane.
+// They do the same operations in the same order so results are bit
+// identical to the scalar ray_tri_intersect().
+int tri_block_intersect_scalar(const tri_block& b, const vec3& orig, const vec3& dir,
+                               Real t_min, Real* t_max);
+int tri_block_intersect_sse42(const tri_block& b, const vec3& orig, const vec3& dir,
+                              Real t_min, Real* t_max);
+int tri_block_intersect_avx2(const tri_block& b, const vec3& orig, const vec3& dir,
+                             Real t_min, Real* t_max);
+
+using tri_block_intersect_fn = int (*)(const tri_block& b, const vec3& orig, const vec3& dir,
+                                       Real t_min, Real* t_max);
+// variant chosen at startup by select_simd_isa(), scalar until then
+extern tri_block_intersect_fn tri_block_intersect_impl;
+
+INLINE int tri_block_intersect(const tri_block& b, const vec3& orig, const vec3& dir,
+                               Real t_min, Real* t_max) {
+    return tri_block_intersect_impl(b, orig, dir, t_min, t_max);
+}
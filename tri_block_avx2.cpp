@@ -0,0 +1,71 @@
+#include "tri_block.h"
+#include "simd_dispatch.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+
+#include <immintrin.h>
+
+// AVX2 variant (no FMA, so rounding matches the scalar code), whole block in
+// one go.
+SIMD_TARGET("avx2")
+int tri_block_intersect_avx2(const tri_block& b, const vec3& orig, const vec3& dir,
+                             Real t_min, Real* t_max) {
+
+    const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    const __m256 e1x = _mm256_loadu_ps(b.e1x), e1y = _mm256_loadu_ps(b.e1y), e1z = _mm256_loadu_ps(b.e1z);
+    const __m256 e2x = _mm256_loadu_ps(b.e2x), e2y = _mm256_loadu_ps(b.e2y), e2z = _mm256_loadu_ps(b.e2z);
+
+    // pvec = cross(dir, e2)
+    const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+    const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    const __m256 inv_det = _mm256_div_ps(one, det);
+
+    // tvec = orig - v0
+    const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(orig.x), _mm256_loadu_ps(b.v0x));
+    const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(orig.y), _mm256_loadu_ps(b.v0y));
+    const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(orig.z), _mm256_loadu_ps(b.v0z));
+
+    const __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+
+    // qvec = cross(tvec, e1)
+    const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+    const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+    const __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+    const __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+
+    __m256 mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(*t_max), _CMP_LT_OQ));
+    if(!_mm256_movemask_ps(mask))
+        return -1;
+
+    // closest of the hit lanes, first one on ties
+    const __m256 tm = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t, mask);
+    __m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    const int lanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(tm, m, _CMP_EQ_OQ)));
+    *t_max = _mm256_cvtss_f32(m);
+    return __builtin_ctz(lanes);
+}
+
+#else
+
+int tri_block_intersect_avx2(const tri_block& b, const vec3& orig, const vec3& dir,
+                             Real t_min, Real* t_max) {
+    return tri_block_intersect_scalar(b, orig, dir, t_min, t_max);
+}
+
+#endif
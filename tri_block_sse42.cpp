@@ -0,0 +1,77 @@
+#include "tri_block.h"
+#include "simd_dispatch.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+
+#include <nmmintrin.h>
+
+// SSE4.2 variant, two 4 wide halves per block.
+SIMD_TARGET("sse4.2")
+int tri_block_intersect_sse42(const tri_block& b, const vec3& orig, const vec3& dir,
+                              Real t_min, Real* t_max) {
+
+    const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+    const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tmin = _mm_set1_ps(t_min);
+    const __m128 inf = _mm_set1_ps(FLT_MAX);
+
+    int best = -1;
+    for(int h = 0; h < kTriBlockWidth; h += 4) {
+        const __m128 e1x = _mm_loadu_ps(b.e1x + h), e1y = _mm_loadu_ps(b.e1y + h), e1z = _mm_loadu_ps(b.e1z + h);
+        const __m128 e2x = _mm_loadu_ps(b.e2x + h), e2y = _mm_loadu_ps(b.e2y + h), e2z = _mm_loadu_ps(b.e2z + h);
+
+        // pvec = cross(dir, e2)
+        const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+        const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+        const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        const __m128 inv_det = _mm_div_ps(one, det);
+
+        // tvec = orig - v0
+        const __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(b.v0x + h));
+        const __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(b.v0y + h));
+        const __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(b.v0z + h));
+
+        const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+        // qvec = cross(tvec, e1)
+        const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(e1y, tz));
+        const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+        const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+        const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+        __m128 mask = _mm_cmpneq_ps(det, zero);
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(u, one));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(t, tmin));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, _mm_set1_ps(*t_max)));
+        if(!_mm_movemask_ps(mask))
+            continue;
+
+        // closest of the hit lanes, first one on ties
+        const __m128 tm = _mm_blendv_ps(inf, t, mask);
+        __m128 m = _mm_min_ps(tm, _mm_shuffle_ps(tm, tm, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        const int lanes = _mm_movemask_ps(_mm_and_ps(mask, _mm_cmpeq_ps(tm, m)));
+        const int lane = __builtin_ctz(lanes);
+        *t_max = _mm_cvtss_f32(m);
+        best = h + lane;
+    }
+    return best;
+}
+
+#else
+
+int tri_block_intersect_sse42(const tri_block& b, const vec3& orig, const vec3& dir,
+                              Real t_min, Real* t_max) {
+    return tri_block_intersect_scalar(b, orig, dir, t_min, t_max);
+}
+
+#endif
@@ -1,13 +1,31 @@
 #pragma once
 
 #include "config.h"
+#include "rng.h"
 #include <math.h>
 
+#if defined(RT_VEC_SSE)
+#include <emmintrin.h>
+
+// x, y, z are kept in the lower lanes of an SSE register so arithmetic is
+// one instruction per operation, w is padding and its value is unspecified
+struct alignas(16) vec3 {
+    union {
+        __m128 m;
+        struct { Real x, y, z, w; };
+    };
+    vec3() = default;
+    vec3(Real xx, Real yy, Real zz):m(_mm_set_ps(0, zz, yy, xx)) {}
+    explicit vec3(__m128 v):m(v) {}
+};
+static_assert(sizeof(Real) == 4, "SSE vec3 needs single precision Real");
+#else
 struct vec3 {
     Real x, y, z;
     vec3() = default;
     vec3(Real xx, Real yy, Real zz):x(xx), y(yy), z(zz) {}
 };
+#endif
 
 using point3 = vec3;
 using color = vec3;
@@ -46,6 +64,72 @@ inline DATA_TYPE clamp(const DATA_TYPE x, const DATA_TYPE lower, const DATA_TYPE
 }
 
 
+#if defined(RT_VEC_SSE)
+INLINE vec3 operator + (const vec3 &u, const vec3 &v){
+	return vec3(_mm_add_ps(u.m, v.m));
+}
+
+INLINE vec3 operator + (const vec3 &v, const float s){
+	return vec3(_mm_add_ps(v.m, _mm_set1_ps(s)));
+}
+
+INLINE vec3 operator - (const vec3 &u, const vec3 &v){
+	return vec3(_mm_sub_ps(u.m, v.m));
+}
+
+INLINE vec3 operator - (const vec3 &v, const float s){
+	return vec3(_mm_sub_ps(v.m, _mm_set1_ps(s)));
+}
+
+INLINE vec3 operator - (const vec3 &v){
+	return vec3(_mm_xor_ps(v.m, _mm_set1_ps(-0.0f)));
+}
+
+INLINE vec3 operator * (const vec3 &u, const vec3 &v){
+	return vec3(_mm_mul_ps(u.m, v.m));
+}
+
+INLINE vec3 operator * (const float s, const vec3 &v){
+	return vec3(_mm_mul_ps(v.m, _mm_set1_ps(s)));
+}
+
+INLINE vec3 operator * (const vec3 &v, const float s){
+	return vec3(_mm_mul_ps(v.m, _mm_set1_ps(s)));
+}
+
+INLINE vec3 operator / (const vec3 &u, const vec3 &v){
+	return vec3(_mm_div_ps(u.m, v.m));
+}
+
+INLINE vec3 operator / (const vec3 &v, const float s){
+	return vec3(_mm_div_ps(v.m, _mm_set1_ps(s)));
+}
+
+INLINE bool operator == (const vec3 &u, const vec3 &v){
+	return (_mm_movemask_ps(_mm_cmpeq_ps(u.m, v.m)) & 7) == 7;
+}
+
+INLINE bool operator != (const vec3 &u, const vec3 &v){
+	return !(u == v);
+}
+
+// sums x, y and z in the same order as the scalar version so both give
+// bit identical results
+INLINE float dot(const vec3 &u, const vec3 &v){
+	const __m128 p = _mm_mul_ps(u.m, v.m);
+	const __m128 xy = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(_mm_add_ss(xy, _mm_movehl_ps(p, p)));
+}
+
+INLINE vec3 cross(const vec3 &u, const vec3 &v){
+	const __m128 u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+	const __m128 u_zxy = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 1, 0, 2));
+	const __m128 v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+	const __m128 v_zxy = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 1, 0, 2));
+	return vec3(_mm_sub_ps(_mm_mul_ps(u_yzx, v_zxy), _mm_mul_ps(v_yzx, u_zxy)));
+}
+
+#else
 INLINE vec3 operator + (const vec3 &u, const vec3 &v){
 	return vec3(u.x + v.x, u.y + v.y, u.z + v.z);
 }
@@ -101,18 +185,19 @@ INLINE float dot(const vec3 &u, const vec3 &v){
 INLINE vec3 cross(const vec3 &u, const vec3 &v){
 	return vec3(u.y * v.z - v.y * u.z, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x);
 }
+#endif
 
 INLINE vec3 normalize(const vec3 &v){
-	Real invLen = Real(1.0) / std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+	Real invLen = Real(1.0) / std::sqrt(dot(v, v));
 	return v * invLen;
 }
 
 INLINE Real length(const vec3 &v){
-	return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+	return sqrtf(dot(v, v));
 }
 
 INLINE Real lengthSqr(const vec3 &v){
-	return v.x * v.x + v.y * v.y + v.z * v.z;
+	return dot(v, v);
 }
 
 INLINE vec3 reflect(const vec3 &v, const vec3 &n) {
@@ -126,38 +211,38 @@ INLINE bool near_zero(const vec3 &v) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-inline Real random_Real() {
+inline Real random_Real(rng& gen) {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    return gen.next_real();
 }
 
-inline Real random_Real(Real min, Real max) {
+inline Real random_Real(rng& gen, Real min, Real max) {
     // Returns a random real in [min,max).
-    return min + (max-min)*random_Real();
+    return min + (max-min)*random_Real(gen);
 }
 
-INLINE vec3 random_vector(Real vmin, Real vmax) {
-    return vec3(random_Real(vmin, vmax), random_Real(vmin, vmax), random_Real(vmin, vmax));
+INLINE vec3 random_vector(rng& gen, Real vmin, Real vmax) {
+    return vec3(random_Real(gen, vmin, vmax), random_Real(gen, vmin, vmax), random_Real(gen, vmin, vmax));
 }
 
 
-INLINE vec3 random_in_unit_disk() {
+INLINE vec3 random_in_unit_disk(rng& gen) {
     while (true) {
-        auto p = vec3(random_Real(-1,1), random_Real(-1,1), 0);
+        auto p = vec3(random_Real(gen, -1,1), random_Real(gen, -1,1), 0);
         if (lengthSqr(p) >= 1) continue;
         return p;
     }
 }
 
-INLINE vec3 random_in_unit_sphere() {
+INLINE vec3 random_in_unit_sphere(rng& gen) {
     while (true) {
-        auto p = random_vector(-1,1);
+        auto p = random_vector(gen, -1,1);
         if (lengthSqr(p)>= 1) continue;
         return p;
     }
 }
 
-INLINE vec3 random_unit_vector() {
-    return normalize(random_in_unit_sphere());
+INLINE vec3 random_unit_vector(rng& gen) {
+    return normalize(random_in_unit_sphere(gen));
 }
 
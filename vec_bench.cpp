@@ -0,0 +1,100 @@
+// Times vec3 operations used by shading, built once per vec3 backend
+// (vec_bench_scalar and vec_bench_sse) so the two can be compared,
+// usage: vec_bench [num vectors] [repeats]
+#include "config.h"
+#include "vec.h"
+#include "rng.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// sum of all components, keeps results alive and shows whether both
+// backends computed the same values
+double checksum(const std::vector<vec3>& v) {
+    double sum = 0;
+    for(const vec3& x: v) {
+        sum += (double)x.x + (double)x.y + (double)x.z;
+    }
+    return sum;
+}
+
+template<typename FN>
+void run(const char* name, int count, int repeats, FN&& fn) {
+    auto t0 = std::chrono::steady_clock::now();
+    double sum = 0;
+    for(int r=0; r<repeats; ++r) {
+        sum += fn();
+    }
+    const double t = seconds_since(t0);
+    printf("%-10s %6.2f ns/op  (checksum %.6e)\n", name, 1e9 * t / ((double)count * repeats), sum);
+}
+
+}
+
+int main(int argc, char** argv) {
+
+    const int count = argc > 1 ? atoi(argv[1]) : 4096;
+    const int repeats = argc > 2 ? atoi(argv[2]) : 20000;
+
+#if defined(RT_VEC_SSE)
+    printf("vec3 backend: SSE, sizeof(vec3) %d\n", (int)sizeof(vec3));
+#else
+    printf("vec3 backend: scalar, sizeof(vec3) %d\n", (int)sizeof(vec3));
+#endif
+
+    rng gen(3, 3);
+    std::vector<vec3> a(count), b(count), out(count);
+    for(int i=0; i<count; ++i) {
+        a[i] = random_vector(gen, -1, 1);
+        b[i] = random_unit_vector(gen);
+    }
+
+    run("dot", count, repeats, [&]() {
+        Real sum = 0;
+        for(int i=0; i<count; ++i) {
+            sum += dot(a[i], b[i]);
+        }
+        return (double)sum;
+    });
+
+    run("cross", count, repeats, [&]() {
+        for(int i=0; i<count; ++i) {
+            out[i] = cross(a[i], b[i]);
+        }
+        return checksum(out) / repeats;
+    });
+
+    run("normalize", count, repeats, [&]() {
+        for(int i=0; i<count; ++i) {
+            out[i] = normalize(a[i]);
+        }
+        return checksum(out) / repeats;
+    });
+
+    run("reflect", count, repeats, [&]() {
+        for(int i=0; i<count; ++i) {
+            out[i] = reflect(a[i], b[i]);
+        }
+        return checksum(out) / repeats;
+    });
+
+    // mix of the above as done per hit in ray_color
+    run("shade", count, repeats, [&]() {
+        for(int i=0; i<count; ++i) {
+            const vec3 r = normalize(reflect(a[i], b[i]));
+            const Real n_dot_l = max(dot(b[i], r), Real(0));
+            out[i] = n_dot_l * vec3(0.8f, 0.6f, 0.4f) + cross(r, b[i]);
+        }
+        return checksum(out) / repeats;
+    });
+
+    return 0;
+}